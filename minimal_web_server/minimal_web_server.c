@@ -4,6 +4,9 @@
   Let's build a minimal web server, one that only handles GET and HEAD requests.
 */
 
+// Ask glibc for the Linux-specific calls (`recvmmsg` and friends) on top of plain POSIX.
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -13,6 +16,30 @@
 #include <sys/socket.h> 
 #include <netinet/in.h> 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/filter.h>
+#include <linux/perf_event.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <zlib.h>
 
 /* 
   The HTTP protocol defaults to port 80 when not not explicitly stated otherwise.
@@ -25,6 +52,115 @@
 
 #define WEBROOT "./mws_root"
 
+/*
+  The number of worker threads.  Each one runs its own accept loop on its own listening socket, so
+  WORKERS requests can be in progress at once.
+*/
+#define WORKERS 4
+
+/*
+  The CPUs the workers are pinned to.  "auto" spreads them over the CPUs we're allowed to run on,
+  taking one from each NUMA node in turn; "none" leaves them to the scheduler; anything else is a
+  list such as "0-3,8-11", of which worker i takes the i-th CPU (wrapping around if it's short).
+  Build with `-DWORKER_CPUS='"0-3"'` (say) to change it.
+
+  A pinned worker never moves between cores, let alone between sockets, so its caches stay warm and
+  the memory it allocates comes from its own NUMA node (see `place_workers`).
+*/
+#ifndef WORKER_CPUS
+#define WORKER_CPUS "auto"
+#endif
+#define MAX_NUMA_NODES 16
+
+/*
+  With REUSEPORT_STEERING on (the default; build with `-DREUSEPORT_STEERING=0` to turn it off), a
+  small BPF program tells the kernel, for every new connection, to pick the listening socket of the
+  worker pinned to the CPU that's handling the connection's packets (see `steer_connections`).
+*/
+#ifndef REUSEPORT_STEERING
+#define REUSEPORT_STEERING 1
+#endif
+
+/*
+  How many connections a worker takes off the listen queue each time it wakes up, and how long a
+  client may keep us waiting for its request (or for room to send the response) before we give up.
+*/
+#define ACCEPT_BATCH 16
+#define CLIENT_TIMEOUT_SECONDS 10
+
+/*
+  TCP_DEFER_ACCEPT: don't wake us for a connection until its first bytes have arrived, or this
+  many seconds have passed.  TCP_FASTOPEN: how many connections may be waiting to be accepted with
+  their request already in hand from the SYN packet (see `open_listener`).
+*/
+#define DEFER_ACCEPT_SECONDS 5
+#define FASTOPEN_QUEUE 256
+
+/*
+  Busy polling, for when latency matters more than CPU time.  It's off by default; build with
+  `-DBUSY_POLL_MICROSECONDS=50` (say) to turn it on.
+
+  Going to sleep and being woken up again costs a few microseconds each time.  In busy-poll mode an
+  idle worker doesn't sleep straight away: it keeps checking for new connections for up to
+  BUSY_POLL_MICROSECONDS first, and the sockets ask the kernel to poll the network card's queues
+  directly rather than wait for its interrupts.  So that quiet workers don't burn a core each, the
+  time actually spent spinning adapts to how often connections have been arriving (see `worker`).
+*/
+#ifndef BUSY_POLL_MICROSECONDS
+#define BUSY_POLL_MICROSECONDS 0
+#endif
+#define BUSY_POLL_BUDGET 16 // packets the kernel may pick up from the card per busy poll
+
+unsigned long busy_poll_spin_hits; // connections a spinning worker caught without sleeping
+unsigned long busy_poll_sleeps; // times a worker gave up spinning and went to sleep
+
+// Requests for this url get the server's counters instead of a file.
+#define STATS_URL "/_stats"
+
+/*
+  An experimental listener that serves the same files over UDP, as a stepping stone towards
+  HTTP/3 (which runs over QUIC, which runs over UDP).  It is off by default; build with
+  `-DUDP_LISTENER=1` to turn it on.
+
+  It is NOT QUIC: there is no handshake, encryption, retransmission or congestion control.  A
+  client sends a request line in one datagram and gets the response back as a burst of
+  UDP_SEGMENT_SIZE datagrams.  What it does have is the batched UDP plumbing a QUIC server needs:
+  `recvmmsg` and UDP_GRO on the receive side, and UDP_SEGMENT (GSO) on the send side.
+*/
+#ifndef UDP_LISTENER
+#define UDP_LISTENER 0
+#endif
+#define UDP_PORT 80
+#define UDP_BATCH 16 // datagrams taken from the kernel per `recvmmsg` call
+#define UDP_SEGMENT_SIZE 1200 // QUIC's minimum datagram size, safe on any path
+#define UDP_GSO_SEGMENTS 32 // datagrams handed to the kernel per `sendmsg` call
+#define UDP_GRO_BUFFER_SIZE 65536 // a GRO-coalesced read can be up to 64KB
+
+/*
+  The canned responses.  The status line and headers end with an empty line ("\r\n\r\n"), after
+  which the body (if any) follows.
+*/
+#define OK_HEADER "HTTP/1.0 200 OK\r\nServer: Minimal Web Server\r\n\r\n"
+#define NOT_FOUND_RESPONSE "HTTP/1.0 404 NOT FOUND\r\nServer: Minimal Web Server\r\n\r\n" \
+  "<html><head><title>404 Not Found</title></head>" \
+  "<body><h1>URL not found</h1></body></html>\r\n"
+#define BAD_GATEWAY_RESPONSE "HTTP/1.0 502 BAD GATEWAY\r\nServer: Minimal Web Server\r\n\r\n" \
+  "<html><head><title>502 Bad Gateway</title></head>" \
+  "<body><h1>Upstream server failed</h1></body></html>\r\n"
+#define SERVICE_UNAVAILABLE_RESPONSE "HTTP/1.0 503 SERVICE UNAVAILABLE\r\nServer: Minimal Web Server\r\n\r\n" \
+  "<html><head><title>503 Service Unavailable</title></head>" \
+  "<body><h1>Upstream server is down</h1></body></html>\r\n"
+#define BUSY_RESPONSE "HTTP/1.0 503 SERVICE UNAVAILABLE\r\nServer: Minimal Web Server\r\n\r\n" \
+  "<html><head><title>503 Service Unavailable</title></head>" \
+  "<body><h1>Server is busy</h1></body></html>\r\n"
+/*
+  Sent to clients over their rate limit.  It's the response we send most when under attack, so it's
+  kept short and its length is worked out at compile time (`sizeof`) rather than with `strlen`.
+*/
+#define TOO_MANY_REQUESTS_RESPONSE "HTTP/1.0 429 TOO MANY REQUESTS\r\nServer: Minimal Web Server\r\n" \
+  "Retry-After: 1\r\nContent-Length: 0\r\n\r\n"
+#define STATS_HEADER "HTTP/1.0 200 OK\r\nServer: Minimal Web Server\r\nContent-Type: text/plain\r\n\r\n"
+
 /* 
    `int get_file_size(int fd)` returns the size of the file associated with file descriptor `fd`.
    Returns -1 on failure.
@@ -41,6 +177,27 @@ int get_file_size(int fd) {
   return (int) stat_struct.st_size; 
 }
 
+/*
+  `int wait_for_socket(int sock_fd, short events)` waits until `sock_fd` is ready for `events`
+  (POLLIN to read, POLLOUT to write), for at most CLIENT_TIMEOUT_SECONDS.  Returns 1 if it's ready
+  and 0 if not.
+
+  Client sockets are non-blocking (see `worker`): rather than putting us to sleep, a `recv` with
+  nothing to read or a `send` with no room in the socket's buffer fails with EAGAIN.  That's when
+  we come here to wait.
+*/
+int wait_for_socket(int sock_fd, short events) {
+  struct pollfd poll_fd;
+  int ready;
+
+  poll_fd.fd = sock_fd;
+  poll_fd.events = events;
+  do {
+    ready = poll(&poll_fd, 1, CLIENT_TIMEOUT_SECONDS * 1000);
+  } while (ready == -1 && errno == EINTR);
+  return ready == 1;
+}
+
 /*
    `int send_string(int sockfd, char *buffer)` sends the string `buffer` to the 
    socket `sockfd`.  Returns 1 on success and 0 on failure. 
@@ -51,8 +208,13 @@ int send_string(int sock_fd, char *buffer) {
   bytes_to_send = strlen(buffer); 
   while(bytes_to_send > 0) {
     sent_bytes = send(sock_fd, buffer, bytes_to_send, 0); 
-    if(sent_bytes == -1)
+    if(sent_bytes == -1) {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sock_fd, POLLOUT))
+        continue; // The socket's buffer was full; there's room now.
+      if (errno == EINTR)
+        continue;
       return 0; // Return 0 on send error.
+    }
     bytes_to_send -= sent_bytes;
     buffer += sent_bytes; 
   }
@@ -60,169 +222,5056 @@ int send_string(int sock_fd, char *buffer) {
 }
 
 /*
-  `int read_line(int sockfd, char *dest_buffer)` will read bytes from
-  the socket `sockfd` and write these bytes to `dest_buffer` until it receives
-  the EOL char.
-
-  It returns the number of bytes written to buffer minus the EOL bytes.
+  `int read_line(int sockfd, char *dest_buffer)` will read bytes from
+  the socket `sockfd` and write these bytes to `dest_buffer` until it receives
+  the EOL char.
+
+  It returns the number of bytes written to buffer minus the EOL bytes.
+*/
+int read_line(int sock_fd, char *dest_buffer) { 
+  #define EOL "\r\n" // End-of-line byte sequence
+  #define EOL_SIZE 2
+
+  int eol_indx = 0; // index for EOL matching
+  int received;
+
+  char *ptr; 
+  ptr = dest_buffer;
+
+  /*
+     `recv(int socket, void *buffer, size_t length, int flags)` receives a message from the socket `socket`
+     and stores the message at the location pointed to by the pointer `buffer`. The `length` specifies the
+     number of chars written to the buffer. 
+     
+     In the invocation below, we are reading only one byte from the socket `sock_fd` and storing it in the buffer that
+     is pointed by `ptr`.
+ */
+  while(1) {
+    received = recv(sock_fd, ptr, 1, 0);
+
+    // Nothing to read yet; wait for the client to send some more.
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sock_fd, POLLIN))
+      continue;
+    if (received != 1)
+      break;
+
+    // *ptr matches \r, the first char of the EOL sequence
+    if (*ptr == EOL[eol_indx]) { 
+      eol_indx++; // increment so we can next compare to \n
+      if (eol_indx == EOL_SIZE) { 
+        // We found \r\n, the EOL byte sequence.
+        *(ptr+1-EOL_SIZE) = '\0'; // terminate the string.
+
+        // We've received all the data up to the EOL, so stop writing and return the number of chars written to the buffer.
+        return strlen(dest_buffer);
+      }
+    } else { 
+      eol_indx = 0;
+    }
+    ptr++;
+  }
+  // Didn't find the end-of-line characters. Note buffer dest_buffer still has the message from the `sock_fd`.
+  *ptr = '\0';
+  return 0; 
+}
+
+/*
+  The request headers we use.  A "Range" header asks for part of a file: bytes `range_first` to
+  `range_last`, counting from 0 and inclusive, or, with `range_first` -1, the last `range_last`
+  bytes, or, with `range_last` -1, everything from `range_first` on.  We only do single ranges; a
+  header asking for several, or one we can't make sense of, is ignored, and the whole file sent.
+*/
+struct request_headers {
+  int accepts_gzip; // an "Accept-Encoding" allows gzip
+  int has_range;
+  long range_first;
+  long range_last;
+};
+
+/*
+  `void parse_range(char *value, struct request_headers *headers)` parses the value of a "Range"
+  header, such as "bytes=0-1023", into `headers`.
+*/
+void parse_range(char *value, struct request_headers *headers) {
+  char *end;
+
+  while (*value == ' ')
+    value++;
+  if (strncmp(value, "bytes=", 6) != 0)
+    return;
+  value += 6;
+
+  if (*value == '-') {
+    headers->range_first = -1;
+  } else {
+    if (*value < '0' || *value > '9')
+      return;
+    headers->range_first = strtol(value, &end, 10);
+    if (*end != '-')
+      return;
+    value = end;
+  }
+  value++;
+  if (*value >= '0' && *value <= '9') {
+    headers->range_last = strtol(value, &end, 10);
+  } else if (headers->range_first != -1) {
+    headers->range_last = -1;
+    end = value;
+  } else {
+    return;
+  }
+  while (*end == ' ' || *end == '\r')
+    end++;
+  if (*end != '\0' || (headers->range_first != -1 && headers->range_last != -1 && headers->range_last < headers->range_first))
+    return;
+  headers->has_range = 1;
+}
+
+/*
+  `int skip_headers(int sock_fd, struct request_headers *headers)` reads past the request's header
+  lines, up to and including the empty line that ends them, filling in `headers` from those we
+  use.  Returns 1 on success and 0 if the client stopped sending first.
+
+  We have to read them all anyway: closing a socket that still has unread bytes waiting makes the
+  kernel reset the connection, throwing away any of our response that hasn't reached the client
+  yet.
+
+  Rather than `recv` a byte at a time like `read_line`, we peek (MSG_PEEK) at whatever has arrived,
+  look for the end of the headers in it, and then consume exactly that much.
+*/
+int skip_headers(int sock_fd, struct request_headers *headers) {
+  char buffer[1024];
+  char line[256]; // the header line so far; the rest of a longer one is dropped
+  int line_length = 0;
+  int matched = EOL_SIZE; // `read_line` already took the request line's EOL, so we need one more
+  int peeked;
+  int i;
+
+  memset(headers, 0, sizeof(*headers));
+
+  while (1) {
+    peeked = recv(sock_fd, buffer, sizeof(buffer), MSG_PEEK);
+    if (peeked == -1 && (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sock_fd, POLLIN))))
+      continue;
+    if (peeked <= 0)
+      return 0;
+
+    for (i = 0; i < peeked; i++) {
+      if (buffer[i] == "\r\n\r\n"[matched])
+        matched++;
+      else
+        matched = buffer[i] == '\r' ? 1 : 0;
+
+      if (buffer[i] == '\n') {
+        line[line_length] = '\0';
+        if (strncasecmp(line, "Accept-Encoding:", 16) == 0 && strstr(line, "gzip") != NULL
+            && strstr(line, "gzip;q=0") == NULL)
+          headers->accepts_gzip = 1;
+        else if (strncasecmp(line, "Range:", 6) == 0)
+          parse_range(line + 6, headers);
+        line_length = 0;
+      } else if (line_length < (int) sizeof(line) - 1) {
+        line[line_length++] = buffer[i];
+      }
+
+      if (matched == 2 * EOL_SIZE) {
+        recv(sock_fd, buffer, i + 1, 0);
+        return 1;
+      }
+    }
+    recv(sock_fd, buffer, peeked, 0);
+  }
+}
+
+/*
+  `char *parse_request_line(char *request)` checks that `request` is a GET or HEAD request line and
+  returns a pointer to the url inside it, or NULL if it isn't one we understand.
+
+  If the request is a valid http request, it would be a string that looks something like:
+
+    GET /path/my/awesome/webpage.html HTTP/1.0
+
+  We verify its a valid HTTP request by checking for the substring " HTTP/", then cut the request
+  short at that space so `request` becomes "GET /path/my/awesome/webpage.html".  The method is left
+  in place so callers can still `strncmp` it.
+*/
+char *parse_request_line(char *request) {
+  char *http_check;
+
+  // Note that http_check is a pointer to the first char of the substring.
+  http_check = strstr(request, " HTTP/");
+
+  if (http_check == NULL) {
+    // Not valid HTTP request
+    printf(" Not valid HTTP Request.\n");
+    return NULL;
+  }
+
+  /*
+     We remove the HTTP part from string `request` (since we already know its an HTTP request)
+     by setting the `http_check` pointer (which is currently pointing to the space before H) to 0.
+  */
+  *http_check = 0;
+
+  if (strncmp(request, "GET ", 4) == 0)
+    // If it's a GET request, then the url starts right after "GET "
+    return request+4;
+
+  if (strncmp(request, "HEAD ", 5) == 0)
+    // If it's a HEAD request, then the url starts right after "HEAD "
+    return request+5;
+
+  // Unknown Request
+  printf("Unknown Request\n");
+  return NULL;
+}
+
+/*
+  `void resource_path(char *url, char *resource)` maps `url` onto a file under WEBROOT, and writes
+  that file's path into `resource`.
+*/
+void resource_path(char *url, char *resource) {
+  // If the url string ends in '/', just add on index.html at the end.
+  if (url[strlen(url) -1] == '/')
+    strcat(url, "index.html");
+
+  strcpy(resource, WEBROOT);
+  strcat(resource, url);
+}
+
+/*
+  `int open_resource(char *url, char *resource)` maps `url` onto a file under WEBROOT, writes that
+  file's path into `resource` and opens it read-only.  Returns the file descriptor, or -1 if there
+  is no such file.
+
+  Every listener resolves urls through here (or `resource_path`), so they all agree on which file
+  a url means.
+*/
+int open_resource(char *url, char *resource) {
+  resource_path(url, resource);
+
+  // Connect to the file in read-only mode
+  return open(resource, O_RDONLY, 0);
+}
+
+/*
+  CPU and NUMA placement.  A machine with several processor sockets has several NUMA nodes: each
+  socket has memory of its own, and reaching another socket's memory is markedly slower.
+
+  Linux puts a page of memory on the node of the CPU that first touches it.  So once a worker is
+  pinned to a CPU, its stack, its `malloc` heap (glibc gives each thread its own) and its splice
+  pipe all end up on that CPU's node without further ado.  Only memory the workers share needs
+  placing explicitly: the proxy cache is split into one shard per node, allocated with `numa_alloc`,
+  and each worker uses its own node's shard.
+
+  Packets are handled by whichever CPU the network card's interrupt was steered to.  Every worker
+  has its own listening socket, tagged with the worker's CPU via SO_INCOMING_CPU, and the kernel
+  (Linux 6.2 and later) hands a new connection to the listener tagged with the CPU that received
+  it.  So the connection's socket buffers, already warm in that CPU's caches, are read and written
+  by that same CPU.  The `incoming_cpu_*` counters show how often that works out.
+*/
+struct worker_context {
+  int listen_fd;
+  int cpu;  // the CPU the worker is pinned to, or -1 if it isn't pinned
+  int node; // that CPU's NUMA node
+  int tlb_miss_fd; // the worker's dTLB miss counter (see `open_tlb_counter`), or -1
+  int completion_fd; // eventfd the disk I/O pool wakes the worker with, or -1
+  struct disk_job *completed; // jobs the disk I/O pool has finished for the worker
+  int epoll_fd; // the worker's epoll instance, or -1
+  struct zerocopy_pending *zerocopy_pending; // chains the kernel is still sending from (see `zerocopy_park`)
+};
+
+struct worker_context worker_contexts[WORKERS];
+__thread struct worker_context *current_worker;
+
+unsigned long incoming_cpu_local; // connections whose packets arrived on their worker's own CPU
+unsigned long incoming_cpu_other; // ... on some other CPU
+
+/*
+  `int parse_cpu_list(char *list, int *cpus)` reads a list of CPUs in the kernel's format
+  ("0-3,8,10-11") into `cpus`, which has room for CPU_SETSIZE of them, in the order they're listed.
+  Returns how many there are, or -1 if the list is malformed or empty.
+*/
+int parse_cpu_list(char *list, int *cpus) {
+  char *end;
+  long first;
+  long last;
+  int count = 0;
+
+  while (*list != '\0' && *list != '\n') {
+    first = last = strtol(list, &end, 10);
+    if (end == list)
+      return -1;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list)
+        return -1;
+    }
+    if (first < 0 || last >= CPU_SETSIZE || first > last)
+      return -1;
+    for (; first <= last && count < CPU_SETSIZE; first++)
+      cpus[count++] = first;
+
+    list = end;
+    if (*list == ',')
+      list++;
+  }
+  return count > 0 ? count : -1;
+}
+
+/*
+  `int cpu_node(int cpu)` returns the NUMA node `cpu` belongs to, going by the CPU lists under
+  /sys/devices/system/node.  Machines (or kernels) without NUMA have no such lists: everything is
+  on node 0.
+*/
+int cpu_node(int cpu) {
+  char path[64];
+  char list[1024];
+  int cpus[CPU_SETSIZE];
+  int count;
+  int node;
+  int fd;
+  int i;
+  ssize_t length;
+
+  for (node = 0; node < MAX_NUMA_NODES; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((fd = open(path, O_RDONLY)) == -1)
+      continue;
+    length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (length <= 0)
+      continue;
+    list[length] = '\0';
+    count = parse_cpu_list(list, cpus);
+    for (i = 0; i < count; i++) {
+      if (cpus[i] == cpu)
+        return node;
+    }
+  }
+  return 0;
+}
+
+/*
+  `void place_workers(void)` decides, following WORKER_CPUS, which CPU (and so which NUMA node)
+  each worker runs on, and fills in `worker_contexts` accordingly.
+*/
+void place_workers(void) {
+  static int cpus[CPU_SETSIZE];
+  static int nodes[CPU_SETSIZE];
+  static int ranks[CPU_SETSIZE]; // how many CPUs of the same node come before this one
+  static int order[CPU_SETSIZE];
+  int node_cpus[MAX_NUMA_NODES] = { 0 };
+  int is_auto = strcmp(WORKER_CPUS, "auto") == 0;
+  int count = 0;
+  int ordered = 0;
+  int rank;
+  int cpu;
+  int i;
+  cpu_set_t set;
+
+  for (i = 0; i < WORKERS; i++) {
+    worker_contexts[i].cpu = -1;
+    worker_contexts[i].node = 0;
+    worker_contexts[i].tlb_miss_fd = -1;
+    worker_contexts[i].completion_fd = -1;
+    worker_contexts[i].epoll_fd = -1;
+  }
+
+  if (strcmp(WORKER_CPUS, "none") == 0)
+    return;
+  if (is_auto) {
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == -1)
+      return;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        cpus[count++] = cpu;
+    }
+  } else if ((count = parse_cpu_list(WORKER_CPUS, cpus)) == -1) {
+    printf("%s", "Malformed WORKER_CPUS list, not pinning workers\n");
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    nodes[i] = cpu_node(cpus[i]);
+    ranks[i] = node_cpus[nodes[i]]++;
+  }
+
+  /*
+    An explicit list is taken in the order given ("8-11,0-3" puts worker 0 on CPU 8).  "auto" takes the first CPU of every node, then
+    the second of every node, and so on, so that fewer workers than CPUs are still spread over all
+    the nodes (and listen on CPUs of all the nodes the network card interrupts).
+  */
+  for (rank = 0; ordered < count; rank++) {
+    for (i = 0; i < count; i++) {
+      if (!is_auto)
+        order[ordered++] = i;
+      else if (ranks[i] == rank)
+        order[ordered++] = i;
+    }
+  }
+
+  for (i = 0; i < WORKERS; i++) {
+    worker_contexts[i].cpu = cpus[order[i % count]];
+    worker_contexts[i].node = nodes[order[i % count]];
+  }
+}
+
+/*
+  `void *numa_alloc(long size, int node)` allocates `size` bytes of zeroed memory, preferably on
+  NUMA node `node`, whichever thread touches it first.  It asks for the node with the `mbind`
+  system call (glibc has no wrapper for it); where that's not supported, it's an ordinary
+  allocation.  Returns NULL on failure.  The memory is never freed.
+*/
+void *numa_alloc(long size, int node) {
+  unsigned long nodemask = 1UL << node;
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (memory == MAP_FAILED)
+    return NULL;
+  syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+  return memory;
+}
+
+/*
+  The cache arena.  Everything the caches keep in memory (proxied responses, static files) comes
+  from here rather than from `malloc`.
+
+  Every memory access goes through a translation from virtual to physical address, and the CPU
+  keeps the translations it has used lately in a small cache of its own, the TLB.  With ordinary
+  4KB pages a few thousand entries cover a few tens of megabytes, so hits spread over a big cache
+  miss the TLB nearly every time, and each miss walks the page tables.  A 2MB huge page needs one
+  entry where 4KB pages need 512.
+
+  So each NUMA node gets one arena, a region reserved at startup and backed by, best first:
+
+  1) "hugetlb": explicit huge pages from the kernel's pool, which has to be filled beforehand
+     (`sysctl -w vm.nr_hugepages=...`);
+  2) "thp": ordinary memory marked MADV_HUGEPAGE, which the kernel backs with transparent huge
+     pages whenever it can find them;
+  3) "none": ordinary pages, if transparent huge pages are turned off as well.
+
+  The arena has an allocator of its own, built on size classes.  A request is rounded up to the
+  next class, four classes per power of two (80, 96, 112, 128, 160, ... bytes), so at most a fifth
+  is wasted.  Blocks are cut from the untouched end of the arena, and freed blocks go on their
+  class's free list, to be handed out again for the same class.  Nothing is ever given back to the
+  kernel, and nothing is ever split or merged, which keeps both operations a few instructions long.
+  When the arena runs out, allocations quietly come from `malloc` instead.
+
+  Each worker counts its dTLB load misses with a hardware performance counter, if the kernel lets
+  us (see `open_tlb_counter`), and STATS_URL reports the total.
+*/
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_MIN_BLOCK 64 // the smallest size class
+#define ARENA_MAX_BLOCK (4 * 1024 * 1024) // the largest; anything bigger comes from `malloc`
+#define ARENA_CLASSES 65 // 64 bytes, then four classes per power of two up to ARENA_MAX_BLOCK
+
+// The arenas' combined size.  The caches' budgets, plus a quarter for rounding up to classes.
+#define CACHE_ARENA_SIZE ((PROXY_CACHE_SIZE + FILE_CACHE_SIZE + COMPRESSED_CACHE_SIZE + BLOCK_CACHE_SIZE) / 4 * 5)
+
+struct arena_block {
+  long size_class;
+  struct arena_block *next_free; // while it's on a free list
+  char data[]; // what the caller gets; 16-byte aligned, like `malloc`'s
+};
+
+struct cache_arena {
+  char *base; // NULL if this node has no arena
+  long size;
+  long used; // bytes cut from the arena so far
+  long free_bytes; // bytes sitting on free lists
+  char *pages; // "hugetlb", "thp" or "none"
+  struct arena_block *free_lists[ARENA_CLASSES];
+  pthread_mutex_t lock;
+};
+
+struct cache_arena cache_arenas[MAX_NUMA_NODES];
+unsigned long cache_arena_fallbacks; // allocations that had to come from `malloc`
+
+// Responses restored from a cache snapshot live in its mapping, which stays until we exit.
+char *cache_snapshot_base;
+long cache_snapshot_size;
+
+// `int arena_class(long size)` returns the index of the smallest size class that fits `size` bytes.
+int arena_class(long size) {
+  int shift;
+
+  if (size <= ARENA_MIN_BLOCK)
+    return 0;
+  // `size` is more than 2^shift and at most 2^(shift + 1); there are four classes in between.
+  shift = 63 - __builtin_clzl(size - 1);
+  return 1 + (shift - 6) * 4 + (int) ((size - 1 - (1L << shift)) >> (shift - 2));
+}
+
+// `long arena_class_size(int size_class)` returns the size of the blocks of class `size_class`.
+long arena_class_size(int size_class) {
+  int shift = 6 + (size_class - 1) / 4;
+
+  if (size_class == 0)
+    return ARENA_MIN_BLOCK;
+  return (1L << shift) + ((size_class - 1) % 4 + 1) * (1L << (shift - 2));
+}
+
+/*
+  `int cache_arena_init(struct cache_arena *arena, long size, int node)` reserves `size` bytes
+  for an arena on NUMA node `node`, on the biggest pages it can get.  Returns 0, or -1 if it
+  couldn't reserve the memory at all.
+*/
+int cache_arena_init(struct cache_arena *arena, long size, int node) {
+  unsigned long nodemask = 1UL << node;
+  char *memory;
+  char *aligned;
+
+  size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+  memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (memory != MAP_FAILED) {
+    arena->pages = "hugetlb";
+  } else {
+    /*
+      No pool of huge pages, or not enough in it.  Transparent huge pages only fit in 2MB-aligned
+      stretches of memory, so ask for one huge page more than we need and trim the ends.
+    */
+    memory = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+      return -1;
+    aligned = (char *) (((uintptr_t) memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned > memory)
+      munmap(memory, aligned - memory);
+    munmap(aligned + size, memory + HUGE_PAGE_SIZE - aligned);
+    memory = aligned;
+    arena->pages = madvise(memory, size, MADV_HUGEPAGE) == 0 ? "thp" : "none";
+  }
+
+  // Place it on its node, like `numa_alloc` does.
+  syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+
+  arena->size = size;
+  arena->base = memory;
+  pthread_mutex_init(&arena->lock, NULL);
+  return 0;
+}
+
+/*
+  `void *cache_alloc(long size)` allocates `size` bytes for a cache, from the arena of the current
+  worker's node, or from `malloc` if that's full.  Returns NULL on failure.  Free with `cache_free`.
+*/
+void *cache_alloc(long size) {
+  struct cache_arena *arena = &cache_arenas[current_worker != NULL ? current_worker->node : 0];
+  struct arena_block *block = NULL;
+  int size_class;
+  long class_size;
+
+  if (arena->base != NULL && size + (long) sizeof(struct arena_block) <= ARENA_MAX_BLOCK) {
+    size_class = arena_class(size + sizeof(struct arena_block));
+    class_size = arena_class_size(size_class);
+
+    pthread_mutex_lock(&arena->lock);
+    if (arena->free_lists[size_class] != NULL) {
+      block = arena->free_lists[size_class];
+      arena->free_lists[size_class] = block->next_free;
+      arena->free_bytes -= class_size;
+    } else if (arena->used + class_size <= arena->size) {
+      block = (struct arena_block *) (arena->base + arena->used);
+      block->size_class = size_class;
+      arena->used += class_size;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block != NULL)
+      return block->data;
+  }
+
+  __atomic_fetch_add(&cache_arena_fallbacks, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+/*
+  `void cache_free(void *memory)` frees memory from `cache_alloc`, into whichever arena it came from.
+  Memory in the cache snapshot's mapping isn't ours to free, and is left alone.
+*/
+void cache_free(void *memory) {
+  struct cache_arena *arena;
+  struct arena_block *block;
+  int node;
+
+  if ((char *) memory >= cache_snapshot_base && (char *) memory < cache_snapshot_base + cache_snapshot_size)
+    return;
+  for (node = 0; node < MAX_NUMA_NODES; node++) {
+    arena = &cache_arenas[node];
+    if (arena->base == NULL || (char *) memory < arena->base || (char *) memory >= arena->base + arena->size)
+      continue;
+
+    block = (struct arena_block *) ((char *) memory - offsetof(struct arena_block, data));
+    pthread_mutex_lock(&arena->lock);
+    block->next_free = arena->free_lists[block->size_class];
+    arena->free_lists[block->size_class] = block;
+    arena->free_bytes += arena_class_size(block->size_class);
+    pthread_mutex_unlock(&arena->lock);
+    return;
+  }
+  free(memory);
+}
+
+/*
+  `void open_tlb_counter(struct worker_context *context)` starts counting the current thread's
+  dTLB load misses (its data accesses whose address translation wasn't in the TLB) in a hardware
+  performance counter, with the `perf_event_open` system call.  Counting what the kernel does on our
+  behalf, like copying a cached response into a socket, needs more privileges than counting our own
+  code, so it tries both ways.  If neither is allowed, or the CPU can't count it, there's no count.
+*/
+void open_tlb_counter(struct worker_context *context) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_hv = 1;
+
+  context->tlb_miss_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (context->tlb_miss_fd == -1) {
+    attr.exclude_kernel = 1;
+    context->tlb_miss_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  }
+}
+
+/*
+  Reverse proxy.  A request whose url starts with one of the `proxy_routes` prefixes isn't looked
+  up under WEBROOT.  Instead it is forwarded to an upstream HTTP/1.1 server (an app server running
+  on this machine, say), and the upstream's response is relayed back to the client.
+
+  Opening a fresh TCP connection to the upstream for every request costs a handshake and a pile of
+  system calls, so each worker keeps up to UPSTREAM_POOL_SIZE idle keep-alive connections per route
+  and reuses them.  The pools are per worker (`__thread`), so workers never fight over them.
+*/
+struct proxy_route {
+  char *prefix; // url prefix that selects this route, e.g. "/app/"
+  char *host;   // upstream ip address
+  int port;     // upstream port
+};
+
+struct proxy_route proxy_routes[] = {
+  { "/app/", "127.0.0.1", 8080 },
+};
+
+#define PROXY_ROUTE_COUNT (int) (sizeof(proxy_routes) / sizeof(proxy_routes[0]))
+#define UPSTREAM_POOL_SIZE 8 // idle keep-alive connections each worker keeps per route
+#define UPSTREAM_BUFFER_SIZE 8192 // room for the upstream's status line and headers
+#define UPSTREAM_TIMEOUT_SECONDS 10 // give up on an upstream that goes quiet for this long
+#define UPSTREAM_MAX_FAILS 3 // consecutive failures before an upstream is marked down
+#define UPSTREAM_DOWN_SECONDS 5 // how long a down upstream is skipped before it's tried again
+#define SPLICE_CHUNK 65536 // bytes moved per `splice` call
+#define PROXY_CACHE_BUCKETS 4096 // hash table size of the proxy cache
+#define PROXY_CACHE_SIZE (64 * 1024 * 1024) // bytes of responses the proxy cache keeps in memory
+#define PROXY_CACHE_MAX_OBJECT (1024 * 1024) // bigger responses are never cached
+#define PROXY_CACHE_PASS_SECONDS 60 // how long a url whose response couldn't be cached skips coalescing
+
+/*
+  Upper bounds (in microseconds) of the upstream latency histogram buckets.  Latency is measured
+  from sending the request to receiving the response's status line.
+*/
+long latency_bucket_bounds[] = { 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 };
+#define LATENCY_BUCKETS (int) (sizeof(latency_bucket_bounds) / sizeof(latency_bucket_bounds[0]))
+
+/*
+  What we know about each upstream, shared by all workers.  Health is tracked passively: we never
+  send health checks, we just count how many requests in a row have failed.  Every field is updated
+  with the `__atomic` builtins since any worker may touch it.
+*/
+struct upstream_state {
+  int consecutive_fails;
+  time_t down_until; // while `time(NULL)` is before this, requests get a 503 without trying
+  unsigned long pool_hits; // requests that reused an idle pooled connection
+  unsigned long pool_misses; // requests that had to open a new connection
+  unsigned long latency_buckets[LATENCY_BUCKETS + 1]; // the last bucket is "+Inf"
+  unsigned long latency_sum; // microseconds
+};
+
+struct upstream_state upstream_states[PROXY_ROUTE_COUNT];
+
+// One worker's idle connections to one upstream.
+struct upstream_pool {
+  int idle_fds[UPSTREAM_POOL_SIZE];
+  int idle_count;
+};
+
+__thread struct upstream_pool upstream_pools[PROXY_ROUTE_COUNT];
+
+// The pipe this worker `splice`s response bodies through, created the first time it's needed.
+__thread int splice_pipe[2] = { -1, -1 };
+
+/*
+  A small buffered reader over an upstream connection.  We need one because the status line and
+  headers have to be read line by line, and `recv`ing a byte at a time like `read_line` does would
+  be a lot of system calls for a response that arrives in one packet.
+*/
+struct upstream_reader {
+  int fd;
+  int start; // first unread byte in `buffer`
+  int end;   // one past the last byte in `buffer`
+  char buffer[UPSTREAM_BUFFER_SIZE];
+};
+
+/*
+  `long now_microseconds(void)` returns a monotonic timestamp in microseconds, for timing things.
+*/
+long now_microseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/*
+  `int send_all(int sock_fd, char *buffer, long length)` is `send_string` for buffers that aren't
+  null-terminated.  Returns 1 on success and 0 on failure.
+*/
+int send_all(int sock_fd, char *buffer, long length) {
+  long sent_bytes;
+  while (length > 0) {
+    sent_bytes = send(sock_fd, buffer, length, MSG_NOSIGNAL);
+    if (sent_bytes == -1) {
+      if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sock_fd, POLLOUT)))
+        continue;
+      return 0;
+    }
+    length -= sent_bytes;
+    buffer += sent_bytes;
+  }
+  return 1;
+}
+
+/*
+  `int find_proxy_route(char *url)` returns the index of the route whose prefix `url` starts with,
+  or -1 if the url should be served from WEBROOT.
+*/
+int find_proxy_route(char *url) {
+  int i;
+  for (i = 0; i < PROXY_ROUTE_COUNT; i++) {
+    if (strncmp(url, proxy_routes[i].prefix, strlen(proxy_routes[i].prefix)) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+  `int upstream_acquire(int route_index, int *reused)` returns a connection to the route's upstream,
+  or -1 if none could be made.  An idle pooled connection is preferred; `*reused` says whether we
+  got one.
+*/
+int upstream_acquire(int route_index, int *reused) {
+  struct upstream_pool *pool = &upstream_pools[route_index];
+  struct proxy_route *route = &proxy_routes[route_index];
+  struct sockaddr_in upstream_addr;
+  struct timeval timeout;
+  int upstream_fd;
+  int option_value = 1;
+  char peek;
+
+  while (pool->idle_count > 0) {
+    upstream_fd = pool->idle_fds[--pool->idle_count];
+
+    /*
+      The upstream may have closed this connection while it sat idle.  Peek at it without blocking:
+      "would block" means it's still open and quiet, which is exactly what we want.  Anything else
+      (end of file, or stray bytes we didn't ask for) means it's no good.
+    */
+    if (recv(upstream_fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *reused = 1;
+      __atomic_fetch_add(&upstream_states[route_index].pool_hits, 1, __ATOMIC_RELAXED);
+      return upstream_fd;
+    }
+    close(upstream_fd);
+  }
+
+  *reused = 0;
+  __atomic_fetch_add(&upstream_states[route_index].pool_misses, 1, __ATOMIC_RELAXED);
+
+  if ((upstream_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  upstream_addr.sin_family = AF_INET;
+  upstream_addr.sin_port = htons(route->port);
+  inet_pton(AF_INET, route->host, &upstream_addr.sin_addr);
+  memset(&(upstream_addr.sin_zero), '\0', 8);
+
+  if (connect(upstream_fd, (struct sockaddr *)&upstream_addr, sizeof(struct sockaddr)) == -1) {
+    close(upstream_fd);
+    return -1;
+  }
+
+  // Requests are small and we want them out immediately, so turn off Nagle's algorithm.
+  setsockopt(upstream_fd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int));
+
+  // Don't let an upstream that stops answering hang this worker forever.
+  timeout.tv_sec = UPSTREAM_TIMEOUT_SECONDS;
+  timeout.tv_usec = 0;
+  setsockopt(upstream_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(upstream_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  return upstream_fd;
+}
+
+/*
+  `void upstream_release(int route_index, int upstream_fd)` hands a connection whose response has
+  been read in full back to this worker's pool, or closes it if the pool is already full.
+*/
+void upstream_release(int route_index, int upstream_fd) {
+  struct upstream_pool *pool = &upstream_pools[route_index];
+
+  if (pool->idle_count < UPSTREAM_POOL_SIZE)
+    pool->idle_fds[pool->idle_count++] = upstream_fd;
+  else
+    close(upstream_fd);
+}
+
+/*
+  `void upstream_failed(int route_index)` and `void upstream_succeeded(int route_index, long latency)`
+  feed the passive health check.  UPSTREAM_MAX_FAILS failures in a row take the upstream out of
+  service for UPSTREAM_DOWN_SECONDS; after that the next request acts as a probe, and one more
+  failure takes it straight back out.  A success also records the request's latency.
+*/
+void upstream_failed(int route_index) {
+  struct upstream_state *state = &upstream_states[route_index];
+
+  if (__atomic_add_fetch(&state->consecutive_fails, 1, __ATOMIC_RELAXED) >= UPSTREAM_MAX_FAILS) {
+    __atomic_store_n(&state->down_until, time(NULL) + UPSTREAM_DOWN_SECONDS, __ATOMIC_RELAXED);
+    printf("Upstream %s:%d marked down\n", proxy_routes[route_index].host, proxy_routes[route_index].port);
+  }
+}
+
+void upstream_succeeded(int route_index, long latency) {
+  struct upstream_state *state = &upstream_states[route_index];
+  int bucket = 0;
+
+  __atomic_store_n(&state->consecutive_fails, 0, __ATOMIC_RELAXED);
+
+  while (bucket < LATENCY_BUCKETS && latency > latency_bucket_bounds[bucket])
+    bucket++;
+  __atomic_fetch_add(&state->latency_buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&state->latency_sum, latency, __ATOMIC_RELAXED);
+}
+
+/*
+  `int reader_fill(struct upstream_reader *reader)` reads more bytes from the upstream into the
+  reader's buffer.  Returns the number of bytes read, 0 at end of file and -1 on error (including
+  a full buffer).
+*/
+int reader_fill(struct upstream_reader *reader) {
+  int read_bytes;
+
+  // Slide unread bytes to the front to make room.
+  if (reader->start > 0) {
+    memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (reader->end == UPSTREAM_BUFFER_SIZE)
+    return -1;
+
+  do {
+    read_bytes = recv(reader->fd, reader->buffer + reader->end, UPSTREAM_BUFFER_SIZE - reader->end, 0);
+  } while (read_bytes == -1 && errno == EINTR);
+
+  if (read_bytes > 0)
+    reader->end += read_bytes;
+  return read_bytes;
+}
+
+/*
+  `int reader_line(struct upstream_reader *reader, char *line, int size)` is `read_line` for the
+  upstream: it copies the next line (without its EOL) into `line`.  Returns the line's length, or -1
+  if the connection ended or the line doesn't fit in `size` bytes.
+*/
+int reader_line(struct upstream_reader *reader, char *line, int size) {
+  char *eol;
+  int length;
+
+  while ((eol = memmem(reader->buffer + reader->start, reader->end - reader->start, EOL, EOL_SIZE)) == NULL) {
+    if (reader_fill(reader) <= 0)
+      return -1;
+  }
+
+  length = eol - (reader->buffer + reader->start);
+  if (length >= size)
+    return -1;
+  memcpy(line, reader->buffer + reader->start, length);
+  line[length] = '\0';
+  reader->start += length + EOL_SIZE;
+  return length;
+}
+
+/*
+  `int splice_body(int upstream_fd, int client_sock_fd, long length)` moves `length` bytes (or, if
+  `length` is -1, everything until the upstream closes) from the upstream to the client.  Returns 1
+  if it moved all of them and 0 otherwise.
+
+  `splice` moves data between a file descriptor and a pipe inside the kernel, so by splicing
+  upstream -> pipe -> client the body never gets copied into our memory at all.
+*/
+int splice_body(int upstream_fd, int client_sock_fd, long length) {
+  long in_pipe;
+  long moved;
+
+  if (splice_pipe[0] == -1 && pipe(splice_pipe) == -1)
+    return 0;
+
+  while (length != 0) {
+    in_pipe = splice(upstream_fd, NULL, splice_pipe[1], NULL,
+                     length > 0 && length < SPLICE_CHUNK ? length : SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in_pipe == 0)
+      return length == -1; // the upstream closed; that's only the end of the body if we expected it
+    if (in_pipe == -1) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    if (length > 0)
+      length -= in_pipe;
+
+    while (in_pipe > 0) {
+      moved = splice(splice_pipe[0], NULL, client_sock_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved == -1 && (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(client_sock_fd, POLLOUT))))
+        continue;
+      if (moved <= 0) {
+        // The client went away with bytes still in the pipe.  Throw the pipe away rather than drain it.
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+        return 0;
+      }
+      in_pipe -= moved;
+    }
+  }
+  return 1;
+}
+
+/*
+  `int relay_body(struct upstream_reader *reader, int client_sock_fd, long length)` sends the next
+  `length` bytes of the upstream's response (or everything until it closes, if `length` is -1) to
+  the client.  Bytes already sitting in the reader's buffer go first, the rest is spliced.
+  Returns 1 if it relayed all of them and 0 otherwise.
+*/
+int relay_body(struct upstream_reader *reader, int client_sock_fd, long length) {
+  long buffered = reader->end - reader->start;
+
+  if (length >= 0 && buffered > length)
+    buffered = length;
+  if (buffered > 0) {
+    if (!send_all(client_sock_fd, reader->buffer + reader->start, buffered))
+      return 0;
+    reader->start += buffered;
+    if (length > 0)
+      length -= buffered;
+  }
+  if (length == 0)
+    return 1;
+  return splice_body(reader->fd, client_sock_fd, length);
+}
+
+/*
+  `int relay_chunked_body(struct upstream_reader *reader, int client_sock_fd)` relays a body sent
+  with "Transfer-Encoding: chunked".  Each chunk is a hex size line followed by that many bytes and
+  an EOL; a chunk of size 0 ends the body.  Our clients speak HTTP/1.0, which has no chunks, so we
+  strip the framing and send just the bytes.  Returns 1 if the whole body was relayed.
+*/
+int relay_chunked_body(struct upstream_reader *reader, int client_sock_fd) {
+  char line[256];
+  long chunk_size;
+
+  while (1) {
+    if (reader_line(reader, line, sizeof(line)) == -1)
+      return 0;
+    chunk_size = strtol(line, NULL, 16);
+    if (chunk_size < 0)
+      return 0;
+    if (chunk_size == 0)
+      break;
+    if (!relay_body(reader, client_sock_fd, chunk_size))
+      return 0;
+    if (reader_line(reader, line, sizeof(line)) != 0) // the EOL after the chunk's bytes
+      return 0;
+  }
+
+  // Skip any trailer headers, up to the empty line that ends the body.
+  while (1) {
+    int length = reader_line(reader, line, sizeof(line));
+    if (length == -1)
+      return 0;
+    if (length == 0)
+      return 1;
+  }
+}
+
+/*
+  What an upstream response's status line and headers told us.
+*/
+struct response_info {
+  int status;
+  int keep_alive;       // the upstream will take another request on this connection
+  int chunked;          // the body is sent with "Transfer-Encoding: chunked"
+  long content_length;  // -1 if the headers didn't say
+  long max_age;         // seconds the response may be served from cache; -1 if it mustn't be cached
+  long stale_while_revalidate; // further seconds it may be served stale while it's being refreshed
+};
+
+/*
+  `int parse_cache_control(char *value, struct response_info *info)` reads the directives of a
+  "Cache-Control" header into `info`.  A shared cache like ours must not store responses marked
+  "no-store" or "private", and "no-cache" means every use must be checked with the upstream first,
+  which amounts to the same thing for us: for those it returns 0, and 1 otherwise.  "s-maxage" is
+  meant for shared caches and beats "max-age".
+*/
+int parse_cache_control(char *value, struct response_info *info) {
+  char *directive;
+  int s_maxage_seen = 0;
+
+  if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private"))
+    return 0;
+  if ((directive = strcasestr(value, "s-maxage=")) != NULL) {
+    info->max_age = strtol(directive + 9, NULL, 10);
+    s_maxage_seen = 1;
+  }
+  if (!s_maxage_seen && (directive = strcasestr(value, "max-age=")) != NULL)
+    info->max_age = strtol(directive + 8, NULL, 10);
+  if ((directive = strcasestr(value, "stale-while-revalidate=")) != NULL)
+    info->stale_while_revalidate = strtol(directive + 23, NULL, 10);
+  return 1;
+}
+
+/*
+  `int upstream_exchange(int route_index, int is_head, char *url, char *client_ip,
+                         struct upstream_reader *reader, char *status_line, int size)`
+  sends the GET or HEAD for `url` to the route's upstream and reads back the status line into
+  `status_line`.  Returns 1 on success, with `reader` set up on the connection so the caller can read
+  the rest of the response, and 0 if the upstream couldn't be reached.
+*/
+int upstream_exchange(int route_index, int is_head, char *url, char *client_ip,
+                      struct upstream_reader *reader, char *status_line, int size) {
+  struct proxy_route *route = &proxy_routes[route_index];
+  char upstream_request[1024];
+  int reused;
+  int attempt;
+  long started = 0;
+
+  snprintf(upstream_request, sizeof(upstream_request),
+    "%s %s HTTP/1.1\r\nHost: %s:%d\r\nX-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n",
+    is_head ? "HEAD" : "GET", url, route->host, route->port, client_ip);
+
+  /*
+    If sending the request or reading the status line fails on a pooled connection, the upstream
+    probably closed it just as we picked it up, so try once more on a fresh one.  That's safe
+    because GET and HEAD don't change anything on the upstream.
+  */
+  reader->fd = -1;
+  for (attempt = 0; attempt < 2; attempt++) {
+    if ((reader->fd = upstream_acquire(route_index, &reused)) == -1)
+      break;
+    reader->start = reader->end = 0;
+    started = now_microseconds();
+    if (send_all(reader->fd, upstream_request, strlen(upstream_request))
+        && reader_line(reader, status_line, size) > 0)
+      break;
+    close(reader->fd);
+    reader->fd = -1;
+    if (!reused)
+      break;
+  }
+
+  if (reader->fd == -1) {
+    upstream_failed(route_index);
+    return 0;
+  }
+  upstream_succeeded(route_index, now_microseconds() - started);
+  return 1;
+}
+
+/*
+  `int read_response_head(struct upstream_reader *reader, char *status_line, char *head, int size,
+                          struct response_info *info)`
+  reads the upstream's headers and writes the response head we'll send our client into `head`.
+  Returns the head's length, or -1 if the upstream's response doesn't make sense.
+*/
+int read_response_head(struct upstream_reader *reader, char *status_line, char *head, int size,
+                       struct response_info *info) {
+  char line[UPSTREAM_BUFFER_SIZE];
+  int head_length;
+  int storable = 1; // nothing has ruled out caching; a later header can't rule it back in
+
+  info->keep_alive = 1;
+  info->chunked = 0;
+  info->content_length = -1;
+  info->max_age = -1;
+  info->stale_while_revalidate = 0;
+
+  if (sscanf(status_line, "HTTP/%*d.%*d %d", &info->status) != 1)
+    return -1;
+
+  // Our side of the conversation is HTTP/1.0, so swap the upstream's version for ours.
+  head_length = snprintf(head, size, "HTTP/1.0%s\r\n", strchr(status_line, ' '));
+
+  /*
+    Copy the headers over, except the "hop-by-hop" ones that describe the upstream connection
+    rather than the response.  The ones that say how the body is framed or cached we note down.
+  */
+  while (reader_line(reader, line, sizeof(line)) > 0) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+      info->content_length = strtol(line + 15, NULL, 10);
+    if (strncasecmp(line, "Cache-Control:", 14) == 0 && !parse_cache_control(line + 14, info))
+      storable = 0;
+    if (strncasecmp(line, "Set-Cookie:", 11) == 0)
+      storable = 0; // never hand one user's cookie to another
+    if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      info->chunked = strcasestr(line + 18, "chunked") != NULL;
+      continue;
+    }
+    if (strncasecmp(line, "Connection:", 11) == 0) {
+      info->keep_alive = strcasestr(line + 11, "close") == NULL;
+      continue;
+    }
+    if (strncasecmp(line, "Keep-Alive:", 11) == 0)
+      continue;
+    if (head_length + (int) strlen(line) + 4 < size)
+      head_length += snprintf(head + head_length, size - head_length, "%s\r\n", line);
+  }
+  head_length += snprintf(head + head_length, size - head_length, "\r\n");
+  if (!storable)
+    info->stale_while_revalidate = info->max_age = -1;
+  return head_length;
+}
+
+/*
+  `int reader_read_exact(struct upstream_reader *reader, char *dest, long length)` copies the next
+  `length` bytes of the upstream's response into `dest`.  Returns 1 on success and 0 otherwise.
+*/
+int reader_read_exact(struct upstream_reader *reader, char *dest, long length) {
+  long buffered = reader->end - reader->start;
+  long read_bytes;
+
+  if (buffered > length)
+    buffered = length;
+  memcpy(dest, reader->buffer + reader->start, buffered);
+  reader->start += buffered;
+  dest += buffered;
+  length -= buffered;
+
+  while (length > 0) {
+    read_bytes = recv(reader->fd, dest, length, 0);
+    if (read_bytes == -1 && errno == EINTR)
+      continue;
+    if (read_bytes <= 0)
+      return 0;
+    dest += read_bytes;
+    length -= read_bytes;
+  }
+  return 1;
+}
+
+/*
+  Epochs.  The caches' hash tables are read by every worker on every request, and changed only
+  now and then, so they're built for readers that take no lock.  A reader can always find its way
+  through a table that's being changed under it, as long as writers link things in with release
+  stores and keep an unlinked object's own links as they were; the hard part is freeing an
+  unlinked object, since a reader that found it before it was unlinked may still be reading it.
+  Epoch-based reclamation answers that:
+
+  - There's a global epoch, and every thread that reads the tables has a slot of its own (on a
+    cache line of its own) where it announces the epoch it read while it's reading.  That store
+    is all `epoch_enter` costs: no shared cache line is written.
+  - A writer that unlinks an object doesn't free it, but hands it to `epoch_retire`, which notes the
+    epoch at the time.
+  - The global epoch only moves on once every thread that's reading has announced the current one.
+    So once it has moved on twice since an object was retired, no reader that could have seen the
+    object is still reading, and it's freed.
+
+  Reading is `epoch_enter`, a walk over the table with acquire loads, and `epoch_exit`.  Anything
+  found has to be used, or a reference to it taken, before `epoch_exit`.  Readers can nest.  A
+  thread that comes after the first EPOCH_READERS to read has no slot, and is counted in
+  `epoch_overflow` instead, which holds the epoch back for as long as it's non-zero.
+
+  The objects retired are linked through a `struct epoch_node` inside them, so retiring can't fail
+  for lack of memory.  `epoch_retire` tries to move the epoch on, and frees what it can, each time
+  it's called: writers are what make garbage, so they pay for collecting it.
+*/
+#define EPOCH_READERS 64
+
+struct epoch_node {
+  struct epoch_node *next;
+  unsigned long epoch; // the epoch it was retired in
+  void (*destroy)(struct epoch_node *node);
+};
+
+struct epoch_slot {
+  unsigned long epoch; // the epoch its thread is reading in, or 0 when it isn't reading
+} __attribute__((aligned(64)));
+
+unsigned long global_epoch = 1;
+struct epoch_slot epoch_slots[EPOCH_READERS];
+int epoch_slot_count; // slots handed out so far
+long epoch_overflow; // threads without a slot that are reading right now
+struct epoch_node *epoch_retired; // waiting for the readers that might see them to finish
+pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER; // guards `epoch_retired`, and moving the epoch on
+unsigned long epoch_freed;
+
+__thread struct epoch_slot *epoch_slot; // this thread's slot, NULL until it first reads
+__thread int epoch_depth; // how deeply this thread's `epoch_enter`s are nested
+__thread int epoch_overflowed; // whether this thread read without a slot, and is counted in `epoch_overflow`
+
+// `void epoch_enter(void)` starts reading the tables.
+void epoch_enter(void) {
+  int slot;
+
+  if (epoch_depth++ > 0)
+    return;
+  if (epoch_slot == NULL && !epoch_overflowed) {
+    slot = __atomic_fetch_add(&epoch_slot_count, 1, __ATOMIC_RELAXED);
+    if (slot < EPOCH_READERS)
+      epoch_slot = &epoch_slots[slot];
+    else
+      epoch_overflowed = 1;
+  }
+  // Sequentially consistent, so the reads that follow can't happen before it's visible to writers.
+  if (epoch_slot != NULL)
+    __atomic_store_n(&epoch_slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+  else
+    __atomic_fetch_add(&epoch_overflow, 1, __ATOMIC_SEQ_CST);
+}
+
+// `void epoch_exit(void)` stops reading the tables.
+void epoch_exit(void) {
+  if (--epoch_depth > 0)
+    return;
+  if (epoch_slot != NULL)
+    __atomic_store_n(&epoch_slot->epoch, 0, __ATOMIC_RELEASE);
+  else
+    __atomic_fetch_sub(&epoch_overflow, 1, __ATOMIC_RELEASE);
+}
+
+/*
+  `void epoch_retire(struct epoch_node *node, void (*destroy)(struct epoch_node *node))` calls
+  `destroy` on `node` once no reader can still see the object it's part of, which the caller has
+  just unlinked.  `destroy` may be called right away, or by a later `epoch_retire` in another
+  thread, so it must not take the locks the callers of `epoch_retire` hold.
+*/
+void epoch_retire(struct epoch_node *node, void (*destroy)(struct epoch_node *node)) {
+  struct epoch_node **link = &epoch_retired;
+  unsigned long epoch;
+  unsigned long reader_epoch;
+  int readers = __atomic_load_n(&epoch_slot_count, __ATOMIC_RELAXED);
+  int i;
+
+  if (readers > EPOCH_READERS)
+    readers = EPOCH_READERS;
+
+  pthread_mutex_lock(&epoch_lock);
+  epoch = global_epoch;
+  node->epoch = epoch;
+  node->destroy = destroy;
+  node->next = epoch_retired;
+  epoch_retired = node;
+
+  // Pairs with the store in `epoch_enter`: either we see the reader's epoch, or it sees our unlink.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (i = 0; i < readers; i++) {
+    reader_epoch = __atomic_load_n(&epoch_slots[i].epoch, __ATOMIC_ACQUIRE);
+    if (reader_epoch != 0 && reader_epoch != epoch)
+      break;
+  }
+  if (i == readers && __atomic_load_n(&epoch_overflow, __ATOMIC_ACQUIRE) == 0)
+    __atomic_store_n(&global_epoch, ++epoch, __ATOMIC_RELEASE);
+
+  while ((node = *link) != NULL) {
+    if (node->epoch + 2 > epoch) {
+      link = &node->next;
+      continue;
+    }
+    *link = node->next;
+    node->destroy(node);
+    epoch_freed++;
+  }
+  pthread_mutex_unlock(&epoch_lock);
+}
+
+/*
+  A response kept in the proxy cache or the file cache: the head we send clients followed by the
+  body, in one block from the cache arena.  Several workers may be sending the same response while
+  another replaces it in the cache, so it's reference counted, and freed when the last of them lets
+  go.
+*/
+struct file_cache_entry;
+
+struct cached_response {
+  int refs;
+  int indexed; // whether it's in the content table (file cache responses)
+  struct file_cache_entry *entries; // the file cache entries holding it, the first charged for it
+  long length;      // bytes in `data`
+  long head_length; // how many of those are the status line and headers
+  unsigned long content_hash; // for the content table: `content_hash` of the body
+  struct cached_response *content_next;
+  struct epoch_node retired; // for dropping the cache's reference once readers are done with it
+  char data[];
+};
+
+/*
+  The content table.  The same file often sits under several paths (versioned copies, symlinked
+  builds, vendored libraries), and the file cache would keep a copy for each.  So each file cache
+  response is indexed by a hash of its body, and a file read into the cache whose body is already
+  there, under some other path, is dropped in favour of the response that's there: the paths' entries
+  share one response, which its reference count keeps until the last of them lets it go.
+
+  The hash is XXH64 (https://github.com/Cyan4973/xxHash), which reads 32 bytes a round in four
+  independent lanes, several GB a second.  It goes in the response's ETag too, so the copies of a
+  file under different paths get the same ETag, and a changed file a new one.  Matching hashes
+  aren't taken on trust: the bodies are compared before a response is shared.
+
+  The table is only used when a file is read into the cache and when a response is freed, not on
+  cache hits, so a mutex does for it.  A response found in the table with no references left is
+  about to be freed and taken out, so it isn't shared.
+*/
+#define CONTENT_TABLE_BUCKETS 4096
+#define FILE_HEAD "HTTP/1.0 200 OK\r\nServer: Minimal Web Server\r\nETag: \"%016lx\"\r\n\r\n"
+#define FILE_HEAD_LENGTH (sizeof(OK_HEADER) - 1 + sizeof("ETag: \"0123456789abcdef\"\r\n") - 1)
+
+#define XXH_PRIME_1 0x9E3779B185EBCA87UL
+#define XXH_PRIME_2 0xC2B2AE3D27D4EB4FUL
+#define XXH_PRIME_3 0x165667B19E3779F9UL
+#define XXH_PRIME_4 0x85EBCA77C2B2AE63UL
+#define XXH_PRIME_5 0x27D4EB2F165667C5UL
+#define XXH_ROTATE(value, bits) (((value) << (bits)) | ((value) >> (64 - (bits))))
+
+struct cached_response *content_table[CONTENT_TABLE_BUCKETS];
+pthread_mutex_t content_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long content_shared; // files read into the cache that shared a response already there
+unsigned long content_shared_bytes; // ... and the bytes that saved
+
+unsigned long xxh_round(unsigned long accumulator, unsigned long input) {
+  accumulator += input * XXH_PRIME_2;
+  return XXH_ROTATE(accumulator, 31) * XXH_PRIME_1;
+}
+
+unsigned long xxh_merge(unsigned long hash, unsigned long accumulator) {
+  hash ^= xxh_round(0, accumulator);
+  return hash * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+// `unsigned long content_hash(char *data, long length)` is XXH64 of `length` bytes at `data`, with seed 0.
+unsigned long content_hash(char *data, long length) {
+  unsigned char *next = (unsigned char *) data;
+  unsigned char *end = next + length;
+  unsigned long lanes[4] = { XXH_PRIME_1 + XXH_PRIME_2, XXH_PRIME_2, 0, -XXH_PRIME_1 };
+  unsigned long hash;
+  unsigned long word;
+  unsigned int half;
+  int i;
+
+  if (length >= 32) {
+    for (; end - next >= 32; next += 32) {
+      for (i = 0; i < 4; i++) {
+        memcpy(&word, next + 8 * i, 8);
+        lanes[i] = xxh_round(lanes[i], word);
+      }
+    }
+    hash = XXH_ROTATE(lanes[0], 1) + XXH_ROTATE(lanes[1], 7) + XXH_ROTATE(lanes[2], 12) + XXH_ROTATE(lanes[3], 18);
+    for (i = 0; i < 4; i++)
+      hash = xxh_merge(hash, lanes[i]);
+  } else {
+    hash = XXH_PRIME_5;
+  }
+  hash += length;
+
+  for (; end - next >= 8; next += 8) {
+    memcpy(&word, next, 8);
+    hash ^= xxh_round(0, word);
+    hash = XXH_ROTATE(hash, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+  }
+  if (end - next >= 4) {
+    memcpy(&half, next, 4);
+    hash ^= half * XXH_PRIME_1;
+    hash = XXH_ROTATE(hash, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+    next += 4;
+  }
+  for (; next < end; next++) {
+    hash ^= *next * XXH_PRIME_5;
+    hash = XXH_ROTATE(hash, 11) * XXH_PRIME_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+/*
+  `void file_response_head(struct cached_response *response)` fills in the head of a file cache
+  response, `FILE_HEAD_LENGTH` bytes left free in front of the file, once the file is read in.
+*/
+void file_response_head(struct cached_response *response) {
+  char head[FILE_HEAD_LENGTH + 1];
+
+  response->content_hash = content_hash(response->data + FILE_HEAD_LENGTH, response->length - FILE_HEAD_LENGTH);
+  snprintf(head, sizeof(head), FILE_HEAD, response->content_hash);
+  memcpy(response->data, head, FILE_HEAD_LENGTH);
+}
+
+/*
+  `struct cached_response *content_table_share(struct cached_response *response, int *shared)`
+  returns a response with the same bytes as `response` that's in the content table already, taking
+  a reference to it, and frees `response`, which nothing else may be using yet; `*shared` is set
+  then.  If there's no such response, it puts `response` in the table and returns it.
+*/
+struct cached_response *content_table_share(struct cached_response *response, int *shared) {
+  struct cached_response **bucket = &content_table[response->content_hash % CONTENT_TABLE_BUCKETS];
+  struct cached_response *other;
+  int refs;
+
+  pthread_mutex_lock(&content_table_lock);
+  for (other = *bucket; other != NULL; other = other->content_next) {
+    if (other->content_hash != response->content_hash || other->length != response->length
+        || memcmp(other->data, response->data, response->length) != 0)
+      continue;
+    refs = __atomic_load_n(&other->refs, __ATOMIC_RELAXED);
+    while (refs > 0 && !__atomic_compare_exchange_n(&other->refs, &refs, refs + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    if (refs > 0)
+      break;
+  }
+  if (other == NULL) {
+    response->content_next = *bucket;
+    response->indexed = 1;
+    *bucket = response;
+  }
+  pthread_mutex_unlock(&content_table_lock);
+
+  *shared = other != NULL;
+  if (other == NULL)
+    return response;
+  __atomic_fetch_add(&content_shared, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&content_shared_bytes, response->length, __ATOMIC_RELAXED);
+  cache_free(response);
+  return other;
+}
+
+// `void content_table_remove(struct cached_response *response)` takes `response` out of the content table.
+void content_table_remove(struct cached_response *response) {
+  struct cached_response **link = &content_table[response->content_hash % CONTENT_TABLE_BUCKETS];
+
+  pthread_mutex_lock(&content_table_lock);
+  while (*link != response)
+    link = &(*link)->content_next;
+  *link = response->content_next;
+  pthread_mutex_unlock(&content_table_lock);
+}
+
+void cached_response_release(struct cached_response *response) {
+  if (__atomic_sub_fetch(&response->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (response->indexed)
+      content_table_remove(response);
+    cache_free(response);
+  }
+}
+
+// `void cached_response_retired(struct epoch_node *node)` drops a retired response's cache reference.
+void cached_response_retired(struct epoch_node *node) {
+  cached_response_release((struct cached_response *) ((char *) node - offsetof(struct cached_response, retired)));
+}
+
+/*
+  Buffer chains.  A response is often pieces from several places: a head we've just formatted, a
+  cached body, or slices of several cached blocks, or a range of a file on disk.  Rather than copy
+  them together into a fresh buffer, we list them in a `buffer_chain`, and `chain_send` sends them
+  from where they are: each run of pieces in memory with one `sendmsg`, the kernel gathering them
+  itself, and each piece of a file with `sendfile`, which goes from the page cache to the socket
+  without passing through us at all.
+
+  A piece of a cached response holds a reference to it while it's in the chain, so the cache can
+  throw the response out meanwhile without pulling it from under us.  Any number of connections
+  can be sending the same cached bytes like this, and none of them copies them.  The socket may
+  take only part of what's offered; the chain then moves its start up past what went, and carries
+  on from there.
+
+  Even `sendmsg` copies the bytes into the socket's buffer, which for a 1MB cached file is most of
+  the work of sending it.  With MSG_ZEROCOPY, the kernel sends straight from our pages instead, and
+  tells us, on the socket's error queue, when it's done with them, which is when the client has
+  acknowledged them; until then the chain keeps its references, so the cache can't reuse the memory
+  under the kernel (see `zerocopy_park`).  Pinning the pages and reading
+  the notification cost more than copying a few KB, so only runs with a cached buffer of at least
+  ZEROCOPY_THRESHOLD bytes go that way (build with `-DZEROCOPY_THRESHOLD=0` to turn it off).  The
+  kernel copies anyway for a client on this host, and says so; the chain then goes back to copying.
+*/
+#define CHAIN_LINKS 32
+#ifndef ZEROCOPY_THRESHOLD
+#define ZEROCOPY_THRESHOLD (128 * 1024)
+#endif
+
+struct chain_link {
+  char *data; // bytes in memory, or NULL for a range of the file `fd`
+  long length;
+  struct cached_response *buffer; // the cached response `data` is part of, if it is; referenced
+  int fd;
+  off_t offset;
+};
+
+struct buffer_chain {
+  struct chain_link links[CHAIN_LINKS];
+  int first; // the first link that hasn't been sent in full
+  int count;
+  int zerocopy; // whether to use MSG_ZEROCOPY: -1 until the socket has been asked for it
+  unsigned int zerocopy_sends; // MSG_ZEROCOPY sends made, and
+  unsigned int zerocopy_done; // how many of them the kernel is done with
+};
+
+unsigned long zerocopy_sends; // sends made with MSG_ZEROCOPY
+unsigned long zerocopy_copied; // ... that the kernel copied after all
+unsigned long zerocopy_parked; // chains left to the worker, the kernel not being done with them yet
+unsigned long zerocopy_resets; // connections reset because the client acknowledged nothing
+unsigned long zerocopy_abandoned; // chains whose buffers were left pinned, the kernel never being done with them
+
+void chain_init(struct buffer_chain *chain) {
+  chain->first = 0;
+  chain->count = 0;
+  chain->zerocopy = ZEROCOPY_THRESHOLD > 0 ? -1 : 0;
+  chain->zerocopy_sends = 0;
+  chain->zerocopy_done = 0;
+}
+
+/*
+  `int chain_add_memory(struct buffer_chain *chain, char *data, long length, struct cached_response *buffer)`
+  appends the `length` bytes at `data` to `chain`.  If they're part of the cached response
+  `buffer`, the chain takes a reference to it; otherwise (`buffer` NULL) they have to stay put until
+  the chain has been sent, like a string constant or a buffer of the caller's.  Returns 0 if the
+  chain is full.
+*/
+int chain_add_memory(struct buffer_chain *chain, char *data, long length, struct cached_response *buffer) {
+  struct chain_link *link;
+
+  if (chain->count == CHAIN_LINKS)
+    return 0;
+  link = &chain->links[chain->count++];
+  link->data = data;
+  link->length = length;
+  link->buffer = buffer;
+  link->fd = -1;
+  link->offset = 0;
+  if (buffer != NULL)
+    __atomic_fetch_add(&buffer->refs, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+  `int chain_add_file(struct buffer_chain *chain, int fd, off_t offset, long length)` appends
+  `length` bytes of the file open as `fd`, from `offset` on, to `chain`.  The file has to stay open
+  until the chain has been sent.  Returns 0 if the chain is full.
+*/
+int chain_add_file(struct buffer_chain *chain, int fd, off_t offset, long length) {
+  struct chain_link *link;
+
+  if (chain->count == CHAIN_LINKS)
+    return 0;
+  link = &chain->links[chain->count++];
+  link->data = NULL;
+  link->length = length;
+  link->buffer = NULL;
+  link->fd = fd;
+  link->offset = offset;
+  return 1;
+}
+
+/*
+  `void chain_consume(struct buffer_chain *chain, long bytes)` moves the start of `chain` up past
+  `bytes` sent.  The links sent keep their references: the kernel may still be sending from them.
+*/
+void chain_consume(struct buffer_chain *chain, long bytes) {
+  struct chain_link *link;
+
+  while (chain->first < chain->count) {
+    link = &chain->links[chain->first];
+    if (bytes < link->length) {
+      if (link->data != NULL)
+        link->data += bytes; // `sendfile` moves a file link's offset itself
+      link->length -= bytes;
+      return;
+    }
+    bytes -= link->length;
+    chain->first++;
+  }
+}
+
+/*
+  `void chain_truncate(struct buffer_chain *chain, int count)` drops the links of `chain` from the
+  `count`th on, not yet sent, and their references.
+*/
+void chain_truncate(struct buffer_chain *chain, int count) {
+  int i;
+
+  for (i = count; i < chain->count; i++) {
+    if (chain->links[i].buffer != NULL)
+      cached_response_release(chain->links[i].buffer);
+  }
+  chain->count = count;
+}
+
+// `void chain_release(struct buffer_chain *chain)` empties `chain`, dropping its references.
+void chain_release(struct buffer_chain *chain) {
+  chain_truncate(chain, 0);
+  chain->first = 0;
+}
+
+/*
+  `int zerocopy_reap(int sock_fd, struct buffer_chain *chain)` reads the notifications waiting on
+  `sock_fd`'s error queue, without waiting for more, and counts the sends they say the kernel is
+  done with towards `chain`.  Each covers a range of sends, numbered in the order they were made.
+  Returns how many notifications it read.
+*/
+int zerocopy_reap(int sock_fd, struct buffer_chain *chain) {
+  char control[128];
+  struct msghdr message;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *error;
+  int count = 0;
+
+  for (;;) {
+    memset(&message, 0, sizeof(message));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(sock_fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      return count;
+    count++;
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+        continue;
+      error = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      chain->zerocopy_done += error->ee_data - error->ee_info + 1;
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // the client is on this host: its copy is made on delivery, so ours would be cheaper
+        __atomic_fetch_add(&zerocopy_copied, error->ee_data - error->ee_info + 1, __ATOMIC_RELAXED);
+        chain->zerocopy = 0;
+      }
+    }
+  }
+}
+
+// `void zerocopy_reset(int sock_fd)` resets the connection, so the kernel drops what it hasn't sent.
+void zerocopy_reset(int sock_fd) {
+  struct sockaddr address;
+
+  // Connecting a TCP socket to AF_UNSPEC disconnects it, with a reset, and leaves the descriptor open.
+  memset(&address, 0, sizeof(address));
+  address.sa_family = AF_UNSPEC;
+  connect(sock_fd, &address, sizeof(address));
+  __atomic_fetch_add(&zerocopy_resets, 1, __ATOMIC_RELAXED);
+}
+
+/*
+  `int zerocopy_wait(int sock_fd, struct buffer_chain *chain)` waits until the kernel is done with
+  every MSG_ZEROCOPY send `chain` made, resetting the connection if the client acknowledges nothing
+  for CLIENT_TIMEOUT_SECONDS.  Returns 1 once it is, and 0 if it isn't even then.  It's for when
+  the chain can't be parked.
+*/
+int zerocopy_wait(int sock_fd, struct buffer_chain *chain) {
+  time_t deadline = time(NULL) + CLIENT_TIMEOUT_SECONDS;
+  socklen_t length = sizeof(int);
+  int reset = 0;
+  int error;
+
+  while (chain->zerocopy_done != chain->zerocopy_sends) {
+    if (zerocopy_reap(sock_fd, chain) == 0) {
+      // A socket error also wakes `poll` for POLLERR: clear it, or we'd spin.
+      getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (time(NULL) >= deadline || !wait_for_socket(sock_fd, 0)) {
+        if (reset)
+          return 0;
+        zerocopy_reset(sock_fd);
+        reset = 1;
+        deadline = time(NULL) + CLIENT_TIMEOUT_SECONDS;
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+  Waiting for the client to acknowledge a big response would hold the worker, and every connection
+  in its queue, for as long as delivery takes.  So a chain the kernel is still sending from when
+  `chain_send` has queued all of it is parked on the worker's `zerocopy_pending` list instead, with
+  its references and a duplicate of the socket, which keeps the socket and its error queue after
+  the caller has closed the connection.  The worker's epoll watches the socket, and the worker
+  reaps the notifications as they come in, freeing the chain when the kernel is done with all of
+  it.  A client that acknowledges nothing for CLIENT_TIMEOUT_SECONDS (the socket's send queue,
+  SIOCOUTQ, doesn't go down) has its connection reset, which makes the kernel drop the rest, and
+  notify us of that.
+*/
+struct zerocopy_pending {
+  int fd; // the duplicate of the client's socket
+  int reset; // whether the connection has been reset
+  int queued; // bytes in the socket's send queue as of the last deadline
+  time_t deadline;
+  struct buffer_chain chain;
+  struct zerocopy_pending *next;
+};
+
+/*
+  `int zerocopy_park(int sock_fd, struct buffer_chain *chain)` hands `chain` over to the current
+  worker, to free once the kernel is done with it, and empties it.  Returns 0 if it can't.
+*/
+int zerocopy_park(int sock_fd, struct buffer_chain *chain) {
+  struct worker_context *context = current_worker;
+  struct zerocopy_pending *pending;
+  struct epoll_event event;
+
+  if (context == NULL || context->epoll_fd == -1 || (pending = malloc(sizeof(struct zerocopy_pending))) == NULL)
+    return 0;
+  if ((pending->fd = fcntl(sock_fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+    free(pending);
+    return 0;
+  }
+  // Only news matters: the socket stays hung up once the caller has shut it down.  EPOLLERR is implied.
+  event.events = EPOLLET;
+  event.data.fd = pending->fd;
+  if (epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, pending->fd, &event) == -1) {
+    close(pending->fd);
+    free(pending);
+    return 0;
+  }
+  pending->reset = 0;
+  if (ioctl(pending->fd, SIOCOUTQ, &pending->queued) == -1)
+    pending->queued = 0;
+  pending->deadline = time(NULL) + CLIENT_TIMEOUT_SECONDS;
+  pending->chain = *chain;
+  pending->next = context->zerocopy_pending;
+  context->zerocopy_pending = pending;
+  chain->first = 0;
+  chain->count = 0;
+  __atomic_fetch_add(&zerocopy_parked, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+  `void zerocopy_collect(struct worker_context *context, int fd)` reaps the notifications for the
+  chain parked with the socket `fd`, or for every chain past its deadline if `fd` is -1, and frees
+  the chains the kernel is done with.  A chain past its deadline gets another if the client is
+  still acknowledging, and has its connection reset if not.
+*/
+void zerocopy_collect(struct worker_context *context, int fd) {
+  struct zerocopy_pending **link = &context->zerocopy_pending;
+  struct zerocopy_pending *pending;
+  time_t now = time(NULL);
+  int queued;
+
+  while ((pending = *link) != NULL) {
+    if (fd != -1 ? pending->fd != fd : now < pending->deadline) {
+      link = &pending->next;
+      continue;
+    }
+    zerocopy_reap(pending->fd, &pending->chain);
+    if (pending->chain.zerocopy_done == pending->chain.zerocopy_sends) {
+      *link = pending->next;
+      chain_release(&pending->chain);
+      close(pending->fd); // which takes it out of epoll too
+      free(pending);
+      continue;
+    }
+    if (now >= pending->deadline && !pending->reset) {
+      if (ioctl(pending->fd, SIOCOUTQ, &queued) == 0 && queued < pending->queued) {
+        pending->queued = queued;
+        pending->deadline = now + CLIENT_TIMEOUT_SECONDS;
+      } else {
+        zerocopy_reset(pending->fd);
+        pending->reset = 1;
+      }
+    }
+    link = &pending->next;
+  }
+}
+
+/*
+  `int chain_send(int sock_fd, struct buffer_chain *chain)` sends everything in `chain` to
+  `sock_fd`, and empties it.  Returns 1 on success and 0 on failure.
+*/
+int chain_send(int sock_fd, struct buffer_chain *chain) {
+  struct iovec iov[CHAIN_LINKS];
+  struct msghdr message;
+  struct chain_link *link;
+  ssize_t sent_bytes;
+  int count;
+  int flags;
+  int large;
+  int on = 1;
+  int sent;
+  int i;
+
+  while (chain->first < chain->count) {
+    link = &chain->links[chain->first];
+    flags = MSG_NOSIGNAL;
+    if (link->data == NULL) {
+      sent_bytes = sendfile(sock_fd, link->fd, &link->offset, link->length);
+      if (sent_bytes == 0 && link->length > 0)
+        break; // the file has got shorter
+    } else {
+      large = 0;
+      for (count = 0; chain->first + count < chain->count && link[count].data != NULL; count++) {
+        if (link[count].buffer != NULL && link[count].length >= ZEROCOPY_THRESHOLD)
+          large = 1;
+      }
+      if (large && chain->zerocopy == -1)
+        chain->zerocopy = setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+      if (large && chain->zerocopy == 1 && chain->zerocopy_done != chain->zerocopy_sends)
+        zerocopy_reap(sock_fd, chain); // has the kernel been copying after all?
+      if (large && chain->zerocopy == 1) {
+        /*
+          The kernel sends from a MSG_ZEROCOPY send's pages after we've returned, so only cached
+          buffers, which the chain keeps references to, go that way.  Any other memory (a head on
+          the caller's stack) goes in a copying send of its own, with MSG_MORE so that it still
+          shares a packet with what follows.
+        */
+        for (count = 1; chain->first + count < chain->count && link[count].data != NULL
+                        && (link[count].buffer != NULL) == (link->buffer != NULL); count++)
+          ;
+        flags |= link->buffer != NULL ? MSG_ZEROCOPY : MSG_MORE;
+      }
+      for (i = 0; i < count; i++) {
+        iov[i].iov_base = link[i].data;
+        iov[i].iov_len = link[i].length;
+      }
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = iov;
+      message.msg_iovlen = count;
+      sent_bytes = sendmsg(sock_fd, &message, flags);
+      if (sent_bytes != -1 && (flags & MSG_ZEROCOPY)) {
+        chain->zerocopy_sends++;
+        __atomic_fetch_add(&zerocopy_sends, 1, __ATOMIC_RELAXED);
+      }
+    }
+    if (sent_bytes == -1) {
+      if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_socket(sock_fd, POLLOUT)))
+        continue;
+      if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        chain->zerocopy = 0; // no memory left to pin pages with: copy
+        continue;
+      }
+      break;
+    }
+    chain_consume(chain, sent_bytes);
+  }
+
+  sent = chain->first == chain->count;
+  if (chain->zerocopy_done != chain->zerocopy_sends)
+    zerocopy_reap(sock_fd, chain);
+  if (chain->zerocopy_done != chain->zerocopy_sends && !zerocopy_park(sock_fd, chain)
+      && !zerocopy_wait(sock_fd, chain)) {
+    // The kernel may yet send from the buffers: better to leak them than let them be reused.
+    __atomic_fetch_add(&zerocopy_abandoned, 1, __ATOMIC_RELAXED);
+    chain->first = 0;
+    chain->count = 0;
+    return 0;
+  }
+  chain_release(chain);
+  return sent;
+}
+
+/*
+  `struct cached_response *proxy_fetch(int client_sock_fd, int is_head, char *url, char *client_ip,
+                                       int route_index, struct response_info *info)`
+  fetches `url` from the route's upstream and relays the response to `client_sock_fd` (pass -1 to
+  fetch without a client, when refreshing the cache).  If the response may be cached it's also
+  kept in memory and returned; otherwise its body is streamed straight through and NULL is returned.
+*/
+struct cached_response *proxy_fetch(int client_sock_fd, int is_head, char *url, char *client_ip,
+                                    int route_index, struct response_info *info) {
+  struct upstream_reader reader;
+  struct cached_response *response = NULL;
+  char head[UPSTREAM_BUFFER_SIZE];
+  char status_line[UPSTREAM_BUFFER_SIZE];
+  int head_length;
+  int complete;
+
+  if (time(NULL) < __atomic_load_n(&upstream_states[route_index].down_until, __ATOMIC_RELAXED)) {
+    printf("503 Upstream Down\n");
+    if (client_sock_fd != -1)
+      send_string(client_sock_fd, SERVICE_UNAVAILABLE_RESPONSE);
+    return NULL;
+  }
+
+  if (!upstream_exchange(route_index, is_head, url, client_ip, &reader, status_line, sizeof(status_line))
+      || (head_length = read_response_head(&reader, status_line, head, sizeof(head), info)) == -1) {
+    if (reader.fd != -1)
+      close(reader.fd);
+    printf("502 Bad Gateway\n");
+    if (client_sock_fd != -1)
+      send_string(client_sock_fd, BAD_GATEWAY_RESPONSE);
+    return NULL;
+  }
+
+  /*
+    A complete 200 response to a GET that the upstream allows us to keep, and that's small enough,
+    is read into memory so it can go in the cache.  We only take bodies with a Content-Length, so
+    we know how much memory to ask for up front.
+  */
+  if (!is_head && info->status == 200 && info->max_age > 0 && !info->chunked
+      && info->content_length >= 0 && info->content_length <= PROXY_CACHE_MAX_OBJECT) {
+    response = cache_alloc(sizeof(struct cached_response) + head_length + info->content_length);
+    if (response != NULL) {
+      response->refs = 1;
+      response->indexed = 0;
+      response->head_length = head_length;
+      response->length = head_length + info->content_length;
+      memcpy(response->data, head, head_length);
+      if (!reader_read_exact(&reader, response->data + head_length, info->content_length)) {
+        cache_free(response);
+        close(reader.fd);
+        return NULL;
+      }
+      if (client_sock_fd != -1)
+        send_all(client_sock_fd, response->data, response->length);
+      if (info->keep_alive && reader.start == reader.end)
+        upstream_release(route_index, reader.fd);
+      else
+        close(reader.fd);
+      return response;
+    }
+  }
+
+  // A response we won't keep is streamed straight through.  Without a client, just drop it.
+  if (client_sock_fd == -1) {
+    close(reader.fd);
+    return NULL;
+  }
+
+  if (!send_all(client_sock_fd, head, head_length)) {
+    close(reader.fd);
+    return NULL;
+  }
+
+  // Relay the body.  Responses to HEAD, and 1xx, 204 and 304 responses, never have one.
+  if (is_head || info->status < 200 || info->status == 204 || info->status == 304)
+    complete = 1;
+  else if (info->chunked)
+    complete = relay_chunked_body(&reader, client_sock_fd);
+  else if (info->content_length >= 0)
+    complete = relay_body(&reader, client_sock_fd, info->content_length);
+  else {
+    // No length given: the body ends when the upstream closes, so the connection can't be reused.
+    info->keep_alive = 0;
+    complete = relay_body(&reader, client_sock_fd, -1);
+  }
+
+  // Only a connection whose response we read exactly to the end can carry the next request.
+  if (complete && info->keep_alive && reader.start == reader.end)
+    upstream_release(route_index, reader.fd);
+  else
+    close(reader.fd);
+  return NULL;
+}
+
+/*
+  The proxy cache.  It keeps cacheable upstream responses in a hash table keyed by url, for as long
+  as their "Cache-Control" header allows, and throws out the least recently used ones once they add
+  up to more than PROXY_CACHE_SIZE bytes.
+
+  It exists to protect the upstreams when a popular url expires, which it does in two ways:
+
+  1) Request coalescing.  While one worker fetches a url, its entry is marked `loading`, and other
+     workers that want the same url wait for that fetch instead of starting their own.  However many
+     clients ask, the upstream sees one request.  That's no use for a url whose response turns out
+     not to be cacheable (an API call, a download too big to keep): the waiters would only fetch it
+     one after another.  So its entry stays, without a response, as a "pass" marker, and for
+     PROXY_CACHE_PASS_SECONDS requests for it go straight to the upstream, in parallel.  Nobody
+     waits on a fetch for longer than UPSTREAM_TIMEOUT_SECONDS either.
+
+  2) Stale-while-revalidate.  For `stale_while_revalidate` seconds after a response goes stale, it
+     keeps being served as is.  The first worker to see it stale marks it `loading`, serves its own
+     client the stale copy, and only then fetches a fresh one.  Nobody waits on the upstream.
+
+  There is one cache per NUMA node (a shard), in that node's memory, and workers only use their own
+  node's shard: a hit never reads another socket's memory.  The price is that a url popular on
+  every node is fetched, and stored, once per node.  Each shard is guarded by its own mutex, and
+  its `loaded` condition is signalled whenever a fetch ends.
+
+  Fresh hits, which is most requests, don't take the mutex: they find the entry like a file cache
+  lookup does, relying on epochs, and mark it used for the CLOCK algorithm instead of moving it in
+  the LRU list.  A response replaced by a newer one is retired, like a removed entry, rather than
+  released, since such a hit may have just picked it up.
+*/
+struct proxy_cache_entry {
+  char *url;
+  struct cached_response *response; // NULL until the first fetch completes
+  time_t fresh_until;
+  time_t stale_until;
+  time_t pass_until; // without a response: until then, requests skip coalescing (0 if it isn't a marker)
+  int loading; // a worker is fetching this url from the upstream right now
+  int used; // whether it has had a fresh hit since it was last at the front of the LRU list
+  struct epoch_node retired;
+  struct proxy_cache_entry *hash_next;
+  struct proxy_cache_entry *lru_prev; // towards the most recently used
+  struct proxy_cache_entry *lru_next; // towards the least recently used
+};
+
+struct proxy_cache_shard {
+  struct proxy_cache_entry *table[PROXY_CACHE_BUCKETS];
+  struct proxy_cache_entry *lru_head; // most recently used
+  struct proxy_cache_entry *lru_tail; // least recently used
+  long bytes;
+  long size; // this shard's share of PROXY_CACHE_SIZE
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+};
+
+struct proxy_cache_shard *proxy_cache_shards[MAX_NUMA_NODES];
+__thread struct proxy_cache_shard *proxy_cache; // the shard of the current worker's node
+
+unsigned long proxy_cache_hits;
+unsigned long proxy_cache_stale_hits;
+unsigned long proxy_cache_misses;
+unsigned long proxy_cache_coalesced; // requests that waited on another worker's fetch
+unsigned long proxy_cache_passes; // requests sent straight to the upstream by a pass marker
+unsigned long proxy_cache_revalidations;
+
+/*
+  `unsigned long hash_string(char *string)` is the FNV-1a hash: cheap, and good enough to spread
+  urls over the buckets of a hash table.
+*/
+unsigned long hash_string(char *string) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*string) {
+    hash ^= (unsigned char) *string++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+// A pass marker counts against the shard's size for its own memory, so that markers get evicted too.
+#define PROXY_PASS_CHARGE(entry) ((long) (sizeof(struct proxy_cache_entry) + strlen((entry)->url) + 1))
+
+// The functions below work on the current worker's shard, and take its lock for granted.
+
+void proxy_cache_lru_unlink(struct proxy_cache_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else proxy_cache->lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else proxy_cache->lru_tail = entry->lru_prev;
+}
+
+void proxy_cache_lru_push(struct proxy_cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = proxy_cache->lru_head;
+  if (proxy_cache->lru_head) proxy_cache->lru_head->lru_prev = entry;
+  else proxy_cache->lru_tail = entry;
+  proxy_cache->lru_head = entry;
+}
+
+// `proxy_cache_find` can also be called without the lock, between `epoch_enter` and `epoch_exit`.
+struct proxy_cache_entry *proxy_cache_find(char *url) {
+  struct proxy_cache_entry *entry = __atomic_load_n(&proxy_cache->table[hash_string(url) % PROXY_CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+  while (entry != NULL && strcmp(entry->url, url) != 0)
+    entry = __atomic_load_n(&entry->hash_next, __ATOMIC_ACQUIRE);
+  return entry;
+}
+
+struct proxy_cache_entry *proxy_cache_insert(char *url) {
+  struct proxy_cache_entry **bucket = &proxy_cache->table[hash_string(url) % PROXY_CACHE_BUCKETS];
+  struct proxy_cache_entry *entry = calloc(1, sizeof(struct proxy_cache_entry));
+
+  if (entry == NULL || (entry->url = strdup(url)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->hash_next = *bucket;
+  __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+  proxy_cache_lru_push(entry);
+  return entry;
+}
+
+// `void proxy_cache_entry_retired(struct epoch_node *node)` frees a retired entry.
+void proxy_cache_entry_retired(struct epoch_node *node) {
+  struct proxy_cache_entry *entry = (struct proxy_cache_entry *) ((char *) node - offsetof(struct proxy_cache_entry, retired));
+
+  if (entry->response != NULL)
+    cached_response_release(entry->response);
+  free(entry->url);
+  free(entry);
+}
+
+void proxy_cache_remove(struct proxy_cache_entry *entry) {
+  struct proxy_cache_entry **link = &proxy_cache->table[hash_string(entry->url) % PROXY_CACHE_BUCKETS];
+
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  __atomic_store_n(link, entry->hash_next, __ATOMIC_RELEASE);
+  proxy_cache_lru_unlink(entry);
+
+  if (entry->response != NULL)
+    proxy_cache->bytes -= entry->response->length;
+  else if (entry->pass_until != 0)
+    proxy_cache->bytes -= PROXY_PASS_CHARGE(entry);
+  epoch_retire(&entry->retired, proxy_cache_entry_retired);
+}
+
+/*
+  `void proxy_cache_finish_load(struct proxy_cache_entry *entry, struct cached_response *response,
+                                struct response_info *info)`
+  ends a fetch started by marking `entry` loading.  A `response` replaces the entry's old one;
+  without one (the upstream failed, or said not to cache) the old one, if any, is kept, and an
+  entry with none becomes a pass marker.  Either way the waiting workers are woken up.
+*/
+void proxy_cache_finish_load(struct proxy_cache_entry *entry, struct cached_response *response,
+                             struct response_info *info) {
+  struct proxy_cache_entry *victim;
+  struct proxy_cache_entry *next;
+  struct proxy_cache_entry *first_moved = NULL;
+  int second_chances = 1;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&proxy_cache->lock);
+  entry->loading = 0;
+
+  if (response != NULL) {
+    if (entry->response != NULL) {
+      proxy_cache->bytes -= entry->response->length;
+      epoch_retire(&entry->response->retired, cached_response_retired);
+    } else if (entry->pass_until != 0) {
+      proxy_cache->bytes -= PROXY_PASS_CHARGE(entry);
+      entry->pass_until = 0;
+    }
+    // The times first: a hit that sees the new response sees them too.
+    __atomic_store_n(&entry->fresh_until, now + info->max_age, __ATOMIC_RELAXED);
+    entry->stale_until = entry->fresh_until + (info->stale_while_revalidate > 0 ? info->stale_while_revalidate : 0);
+    __atomic_store_n(&entry->response, response, __ATOMIC_RELEASE);
+    proxy_cache->bytes += response->length;
+  } else if (entry->response == NULL) {
+    // Nothing to keep.  The waiters, and whoever asks for a while after, fetch for themselves.
+    if (entry->pass_until == 0)
+      proxy_cache->bytes += PROXY_PASS_CHARGE(entry);
+    entry->pass_until = now + PROXY_CACHE_PASS_SECONDS;
+  }
+
+  /*
+    Make room by evicting from the least recently used end, skipping fetches in progress.  Entries
+    used since they were last moved to the front go back there instead, once: the walk stops
+    handing out second chances when it gets to the first entry it moved.
+  */
+  victim = proxy_cache->lru_tail;
+  while (proxy_cache->bytes > proxy_cache->size && victim != NULL) {
+    next = victim->lru_prev;
+    if (victim == first_moved)
+      second_chances = 0;
+    if (second_chances && __atomic_load_n(&victim->used, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&victim->used, 0, __ATOMIC_RELAXED);
+      proxy_cache_lru_unlink(victim);
+      proxy_cache_lru_push(victim);
+      if (first_moved == NULL)
+        first_moved = victim;
+    } else if (!victim->loading && victim != entry) {
+      proxy_cache_remove(victim);
+    }
+    victim = next;
+  }
+
+  pthread_cond_broadcast(&proxy_cache->loaded);
+  pthread_mutex_unlock(&proxy_cache->lock);
+}
+
+/*
+  `void proxy_request(int client_sock_fd, char *request, char *url, char *client_ip, int route_index)`
+  answers a GET or HEAD for a proxied `url`, from the proxy cache if it can, otherwise by fetching
+  it from the upstream of route `route_index`.
+*/
+void proxy_request(int client_sock_fd, char *request, char *url, char *client_ip, int route_index) {
+  struct proxy_cache_entry *entry;
+  struct cached_response *response = NULL;
+  struct response_info info;
+  int is_head = strncmp(request, "HEAD ", 5) == 0;
+  int load = 0; // we're the worker that fetches this url
+  int revalidate = 0; // ... after serving the stale copy
+  int waited = 0;
+  struct timespec wait_until;
+  time_t now;
+
+  // A fresh hit is served without the lock.
+  epoch_enter();
+  entry = proxy_cache_find(url);
+  if (entry != NULL && (response = __atomic_load_n(&entry->response, __ATOMIC_ACQUIRE)) != NULL
+      && time(NULL) < __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&entry->used, __ATOMIC_RELAXED))
+      __atomic_store_n(&entry->used, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&proxy_cache_hits, 1, __ATOMIC_RELAXED);
+  } else {
+    response = NULL;
+  }
+  epoch_exit();
+
+  if (response == NULL) {
+    pthread_mutex_lock(&proxy_cache->lock);
+    while (1) {
+      entry = proxy_cache_find(url);
+      now = time(NULL);
+
+      if (entry != NULL && entry->response != NULL && now < entry->stale_until) {
+        // Fresh, or stale but still servable.  Take a reference so it can't be freed under us.
+        response = entry->response;
+        __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+        proxy_cache_lru_unlink(entry);
+        proxy_cache_lru_push(entry);
+
+        if (now < entry->fresh_until) {
+          __atomic_fetch_add(&proxy_cache_hits, 1, __ATOMIC_RELAXED);
+        } else {
+          __atomic_fetch_add(&proxy_cache_stale_hits, 1, __ATOMIC_RELAXED);
+          if (!entry->loading && !is_head)
+            entry->loading = revalidate = 1;
+        }
+        break;
+      }
+
+      // A HEAD has no body to fill the cache with, so it goes straight to the upstream.
+      if (is_head)
+        break;
+
+      // So, for a while, does a url whose last response couldn't be cached.
+      if (entry != NULL && entry->response == NULL && now < entry->pass_until) {
+        __atomic_fetch_add(&proxy_cache_passes, 1, __ATOMIC_RELAXED);
+        break;
+      }
+
+      if (entry != NULL && entry->loading) {
+        // Another worker is already fetching this url.  Wait for it rather than asking again.
+        if (!waited) {
+          __atomic_fetch_add(&proxy_cache_coalesced, 1, __ATOMIC_RELAXED);
+          clock_gettime(CLOCK_REALTIME, &wait_until);
+          wait_until.tv_sec += UPSTREAM_TIMEOUT_SECONDS;
+          waited = 1;
+        }
+        if (pthread_cond_timedwait(&proxy_cache->loaded, &proxy_cache->lock, &wait_until) == ETIMEDOUT) {
+          // The fetch is stuck: make our own rather than hold this worker, and its queue, any longer.
+          __atomic_fetch_add(&proxy_cache_passes, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        continue;
+      }
+
+      if (entry == NULL)
+        entry = proxy_cache_insert(url);
+      if (entry != NULL) {
+        entry->loading = load = 1;
+        __atomic_fetch_add(&proxy_cache_misses, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    }
+    pthread_mutex_unlock(&proxy_cache->lock);
+  }
+
+  if (response != NULL) {
+    printf("Proxy cache hit\n");
+    send_all(client_sock_fd, response->data, is_head ? response->head_length : response->length);
+    cached_response_release(response);
+
+    if (!revalidate)
+      return;
+
+    // Let the client go before we refresh the entry; it already has everything it asked for.
+    shutdown(client_sock_fd, SHUT_RDWR);
+    __atomic_fetch_add(&proxy_cache_revalidations, 1, __ATOMIC_RELAXED);
+    response = proxy_fetch(-1, 0, url, client_ip, route_index, &info);
+    proxy_cache_finish_load(entry, response, &info);
+    return;
+  }
+
+  response = proxy_fetch(client_sock_fd, is_head, url, client_ip, route_index, &info);
+  if (load)
+    proxy_cache_finish_load(entry, response, &info);
+  else if (response != NULL)
+    cached_response_release(response);
+}
+
+/*
+  The file cache.  Static files of up to FILE_CACHE_MAX_OBJECT bytes are kept in memory, head and
+  all, ready to send: a request for a popular file costs an `open` and an `fstat` instead of a
+  `malloc` and a `read` of the whole file as well.  An entry is only used while the file's inode,
+  size and modification time are still the ones `fstat` reports, so a file changed under WEBROOT is
+  picked up on the next request.  The cache holds up to FILE_CACHE_SIZE bytes of files.
+
+  Unlike the proxy cache there's one file cache for all NUMA nodes: a file is kept once, in the
+  arena of the node whose worker read it first.  Every worker looks up every static file in it, so
+  lookups don't take a lock.  Only changes to the cache (adding a file, throwing one out) take
+  `file_cache_lock`, and they only happen on a miss.
+
+  Lookups without a lock work because an entry never changes once it's in the hash table.  A
+  changed file gets a new entry, which goes in front of the old one in its bucket before the old one
+  is unlinked, so a lookup finds either a complete entry or none.  Unlinked entries are freed, and
+  the cache's reference to their response dropped, through `epoch_retire`.
+
+  Which files stay is decided by W-TinyLFU (https://arxiv.org/abs/1512.00727).  Plain LRU keeps
+  whatever was asked for last, so one crawl through a few thousand cold urls would push out every
+  popular file.  W-TinyLFU keeps the files that are asked for most often, counting recent requests
+  more than old ones:
+
+  - New files go into a small window (FILE_CACHE_WINDOW bytes), an LRU list of its own, which gives
+    them a chance to be asked for again before they have to compete for a place.
+  - Files pushed out of the window are candidates for the main part of the cache, where they go on
+    probation.  A candidate only gets in if it's been asked for more often than the file that would
+    make room for it, the least recently used on probation; otherwise it's the candidate that goes.
+  - A file asked for again while on probation moves up to the protected list (up to
+    FILE_CACHE_PROTECTED bytes), whose least recently used files go back on probation to make room.
+  - How often a file was asked for is estimated by a count-min sketch: FILE_CACHE_SKETCH_ROWS rows
+    of small counters, each row indexed by a different hash of the path.  A request counts one in
+    each row, and the estimate is the smallest of the file's counters, which other files sharing
+    them can only have pushed up.  It remembers files long after they've left the cache, in a few
+    bits each.  Every FILE_CACHE_SKETCH_SAMPLE counts, all counters are halved, so that popularity
+    fades.
+
+  A lookup writes nothing anyone else reads, other than the response's reference count, which it
+  needs to keep the response until it's sent, so it can't move the entry to another list, or count
+  it in the sketch.  Instead it counts a hit in the entry, and marks it as used.  The hits are added
+  to the sketch when the entry's popularity is needed, and the used mark does the moving when the
+  entry reaches the end of its list: a used entry is unmarked and moved up (or to the front of the
+  same list) rather than thrown out, which approximates LRU the way the CLOCK algorithm does.
+*/
+#define FILE_CACHE_SIZE (256 * 1024 * 1024) // bytes of files the file cache keeps in memory
+#define FILE_CACHE_MAX_OBJECT (1024 * 1024) // bigger files are read from disk every time
+#define FILE_CACHE_BUCKETS 4096
+#define FILE_CACHE_WINDOW (FILE_CACHE_SIZE / 100) // bytes of new files on trial
+#define FILE_CACHE_MAIN (FILE_CACHE_SIZE - FILE_CACHE_WINDOW)
+#define FILE_CACHE_PROTECTED (FILE_CACHE_MAIN / 5 * 4) // bytes of the main part for files asked for again
+#define FILE_CACHE_SKETCH_ROWS 4
+#define FILE_CACHE_SKETCH_WIDTH 16384 // counters in a row; a power of two, at most 2^16
+#define FILE_CACHE_SKETCH_MAX 15 // counters stop there: enough to tell popular from not
+#define FILE_CACHE_SKETCH_SAMPLE (10 * FILE_CACHE_SKETCH_WIDTH)
+
+// The lists an entry can be on.
+#define FILE_CACHE_IN_WINDOW 0
+#define FILE_CACHE_ON_PROBATION 1
+#define FILE_CACHE_PROTECTED_LIST 2
+
+struct file_cache_entry {
+  char *path; // the file's path, as built by `open_resource`
+  unsigned long hash; // `hash_string(path)`
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+  struct cached_response *response; // maybe shared with other paths' entries, through the content table
+  long charge; // what it counts for against FILE_CACHE_SIZE: the response's length, or its own if another entry pays that
+  struct file_cache_entry *sharer_prev; // the other entries holding `response`, from `response->entries`
+  struct file_cache_entry *sharer_next;
+  unsigned long hits; // how many requests it has served, kept across restarts by the snapshot
+  unsigned long hits_counted; // how many of those have been added to the sketch
+  int used; // whether it has been looked up since it was last moved to the front of a list
+  int list;
+  struct epoch_node retired;
+  struct file_cache_entry *hash_next;
+  struct file_cache_entry *lru_prev; // towards the most recently used
+  struct file_cache_entry *lru_next; // towards the least recently used
+};
+
+struct file_cache_list {
+  struct file_cache_entry *head; // most recently used
+  struct file_cache_entry *tail; // least recently used
+  long bytes;
+};
+
+struct file_cache_entry *file_cache_table[FILE_CACHE_BUCKETS];
+struct file_cache_list file_cache_lists[3];
+long file_cache_bytes;
+long file_cache_entries;
+unsigned char file_cache_sketch[FILE_CACHE_SKETCH_ROWS][FILE_CACHE_SKETCH_WIDTH];
+long file_cache_sketch_counts; // counted since the counters were last halved
+pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long file_cache_hits;
+unsigned long file_cache_misses;
+unsigned long file_cache_rejections; // files read into the cache but found less popular than what was there
+
+// `void file_cache_entry_retired(struct epoch_node *node)` frees a retired entry.
+void file_cache_entry_retired(struct epoch_node *node) {
+  struct file_cache_entry *entry = (struct file_cache_entry *) ((char *) node - offsetof(struct file_cache_entry, retired));
+
+  cached_response_release(entry->response);
+  free(entry->path);
+  free(entry);
+}
+
+// The functions below take `file_cache_lock` for granted.
+
+void file_cache_lru_unlink(struct file_cache_entry *entry) {
+  struct file_cache_list *list = &file_cache_lists[entry->list];
+
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else list->head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else list->tail = entry->lru_prev;
+  list->bytes -= entry->charge;
+}
+
+// `void file_cache_lru_push(struct file_cache_entry *entry, int list)` puts `entry` at the front of `list`.
+void file_cache_lru_push(struct file_cache_entry *entry, int list) {
+  struct file_cache_list *to = &file_cache_lists[list];
+
+  entry->list = list;
+  entry->lru_prev = NULL;
+  entry->lru_next = to->head;
+  if (to->head) to->head->lru_prev = entry;
+  else to->tail = entry;
+  to->head = entry;
+  to->bytes += entry->charge;
+}
+
+// `void file_cache_lru_append(struct file_cache_entry *entry, int list)` puts `entry` at the end of `list`.
+void file_cache_lru_append(struct file_cache_entry *entry, int list) {
+  struct file_cache_list *to = &file_cache_lists[list];
+
+  entry->list = list;
+  entry->lru_next = NULL;
+  entry->lru_prev = to->tail;
+  if (to->tail) to->tail->lru_next = entry;
+  else to->head = entry;
+  to->tail = entry;
+  to->bytes += entry->charge;
+}
+
+/*
+  Paths whose files have the same bytes share one response, and it's the response's body that
+  takes up the memory, however many entries hold it.  So the first of the entries holding a
+  response is charged for all of it, and the others only for themselves.  When the first one goes
+  (the same path is often back with a new mtime, and the same bytes, before the old entry is out),
+  the next one takes the charge over, so the body counts once for as long as it's cached at all.
+
+  `void file_cache_share(struct file_cache_entry *entry)` counts a new entry among the holders of
+  its response, and sets what it's charged.
+*/
+void file_cache_share(struct file_cache_entry *entry) {
+  struct cached_response *response = entry->response;
+  struct file_cache_entry *first = response->entries;
+
+  entry->sharer_prev = first;
+  if (first == NULL) {
+    entry->charge = response->length;
+    entry->sharer_next = NULL;
+    response->entries = entry;
+    return;
+  }
+  entry->charge = sizeof(struct file_cache_entry) + strlen(entry->path) + 1;
+  entry->sharer_next = first->sharer_next;
+  if (first->sharer_next) first->sharer_next->sharer_prev = entry;
+  first->sharer_next = entry;
+}
+
+/*
+  `void file_cache_unshare(struct file_cache_entry *entry)` takes `entry`, on its way out of the
+  cache, from among the holders of its response, handing its charge for the body on to the next.
+*/
+void file_cache_unshare(struct file_cache_entry *entry) {
+  struct file_cache_entry *next = entry->sharer_next;
+  long body;
+
+  if (next) next->sharer_prev = entry->sharer_prev;
+  if (entry->sharer_prev) {
+    entry->sharer_prev->sharer_next = next;
+    return;
+  }
+  entry->response->entries = next;
+  if (next != NULL) {
+    body = entry->response->length - next->charge;
+    next->charge += body;
+    file_cache_lists[next->list].bytes += body;
+    file_cache_bytes += body;
+  }
+}
+
+// `int file_cache_take_used(struct file_cache_entry *entry)` clears `entry`'s used mark, and returns what it was.
+int file_cache_take_used(struct file_cache_entry *entry) {
+  if (!__atomic_load_n(&entry->used, __ATOMIC_RELAXED))
+    return 0;
+  __atomic_store_n(&entry->used, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+  `void file_cache_sketch_add(unsigned long hash, unsigned long count)` counts `count` requests for
+  the path with hash `hash`.  Each row's counter is picked by a different 16 bits of one
+  multiplicative hash of `hash`.
+*/
+void file_cache_sketch_add(unsigned long hash, unsigned long count) {
+  unsigned long mixed = hash * 0x9e3779b97f4a7c15UL;
+  unsigned char *counter;
+  int row;
+  int i;
+
+  for (row = 0; row < FILE_CACHE_SKETCH_ROWS; row++) {
+    counter = &file_cache_sketch[row][(mixed >> (row * 16)) & (FILE_CACHE_SKETCH_WIDTH - 1)];
+    *counter = *counter + count < FILE_CACHE_SKETCH_MAX ? *counter + count : FILE_CACHE_SKETCH_MAX;
+  }
+
+  file_cache_sketch_counts += count;
+  if (file_cache_sketch_counts >= FILE_CACHE_SKETCH_SAMPLE) {
+    for (row = 0; row < FILE_CACHE_SKETCH_ROWS; row++) {
+      for (i = 0; i < FILE_CACHE_SKETCH_WIDTH; i++)
+        file_cache_sketch[row][i] /= 2;
+    }
+    file_cache_sketch_counts /= 2;
+  }
+}
+
+/*
+  `int file_cache_frequency(struct file_cache_entry *entry)` estimates how often `entry`'s file has
+  been asked for lately, counting its hits so far.
+*/
+int file_cache_frequency(struct file_cache_entry *entry) {
+  unsigned long hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+  unsigned long mixed = entry->hash * 0x9e3779b97f4a7c15UL;
+  int frequency = FILE_CACHE_SKETCH_MAX;
+  int counter;
+  int row;
+
+  if (hits > entry->hits_counted) {
+    file_cache_sketch_add(entry->hash, hits - entry->hits_counted);
+    entry->hits_counted = hits;
+  }
+  for (row = 0; row < FILE_CACHE_SKETCH_ROWS; row++) {
+    counter = file_cache_sketch[row][(mixed >> (row * 16)) & (FILE_CACHE_SKETCH_WIDTH - 1)];
+    if (counter < frequency)
+      frequency = counter;
+  }
+  return frequency;
+}
+
+/*
+  `void file_cache_remove(struct file_cache_entry *entry)` takes `entry` out of the cache and
+  retires it.  Its `hash_next` stays as it was, for lookups still on their way through the bucket.
+*/
+void file_cache_remove(struct file_cache_entry *entry) {
+  struct file_cache_entry **link = &file_cache_table[entry->hash % FILE_CACHE_BUCKETS];
+
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  __atomic_store_n(link, entry->hash_next, __ATOMIC_RELEASE);
+  file_cache_lru_unlink(entry);
+  file_cache_bytes -= entry->charge;
+  file_cache_unshare(entry);
+  file_cache_entries--;
+  epoch_retire(&entry->retired, file_cache_entry_retired);
+}
+
+/*
+  `struct file_cache_entry *file_cache_probation_victim(long *chances)` returns the entry on
+  probation that should make room, if any, after moving the used ones at the end of the list up to
+  the protected list.  Lookups may keep marking entries meanwhile, so it moves no more than
+  `*chances` of them, and takes those it moves from `*chances`.
+*/
+struct file_cache_entry *file_cache_probation_victim(long *chances) {
+  struct file_cache_entry *victim;
+  struct file_cache_entry *demoted;
+
+  while ((victim = file_cache_lists[FILE_CACHE_ON_PROBATION].tail) != NULL && *chances > 0
+         && file_cache_take_used(victim)) {
+    (*chances)--;
+    file_cache_lru_unlink(victim);
+    file_cache_lru_push(victim, FILE_CACHE_PROTECTED_LIST);
+
+    // Make room in the protected list, putting those not used lately back on probation.
+    while (file_cache_lists[FILE_CACHE_PROTECTED_LIST].bytes > FILE_CACHE_PROTECTED) {
+      demoted = file_cache_lists[FILE_CACHE_PROTECTED_LIST].tail;
+      file_cache_lru_unlink(demoted);
+      if (*chances > 0 && file_cache_take_used(demoted)) {
+        (*chances)--;
+        file_cache_lru_push(demoted, FILE_CACHE_PROTECTED_LIST);
+      } else {
+        file_cache_lru_push(demoted, FILE_CACHE_ON_PROBATION);
+      }
+    }
+  }
+  return victim;
+}
+
+/*
+  The compressed tier.  Most of what a web server sends is text, which gzip shrinks several times
+  over, so rather than throw away a file that W-TinyLFU pushes out of the file cache to make room
+  for a more popular one, we keep it gzipped, in a second hash table with COMPRESSED_CACHE_SIZE
+  bytes of its own, and evict from there in LRU order.  Files that gzip doesn't shrink by at least
+  COMPRESSED_CACHE_MIN_SAVING percent aren't kept, and neither are files the file cache turned away
+  on their first request: those haven't shown they'll be wanted again.
+
+  A file cache miss looks in the compressed tier before going to the disk.  A client that accepts
+  gzip gets the compressed response as it is, without our decompressing it, and we send it fewer
+  bytes too.  For any other client it's decompressed back into the file cache, which still beats
+  reading it from disk.
+
+  Compressing takes a while, so it isn't done under `file_cache_lock`.  The file cache only queues
+  the files it pushes out, on a per-thread list, and the thread compresses them once it has let go
+  of the lock.  The tier itself is only used on file cache misses, so a mutex does for it.
+*/
+#define COMPRESSED_CACHE_SIZE (64 * 1024 * 1024)
+#define COMPRESSED_CACHE_BUCKETS 4096
+#define COMPRESSED_CACHE_MIN_SAVING 10 // percent
+#define COMPRESSED_CACHE_LEVEL 6 // zlib's default; 1 is faster, 9 smaller
+#define GZIP_HEADER "HTTP/1.0 200 OK\r\nServer: Minimal Web Server\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n"
+
+struct compressed_entry {
+  char *path;
+  unsigned long hash;
+  dev_t device;
+  ino_t inode;
+  off_t size; // uncompressed
+  struct timespec modified;
+  struct cached_response *response; // GZIP_HEADER and the gzipped file; NULL while it's queued
+  struct cached_response *source; // the file cache's response, while it's queued
+  struct compressed_entry *hash_next; // or the next queued entry
+  struct compressed_entry *lru_prev; // towards the most recently used
+  struct compressed_entry *lru_next; // towards the least recently used
+};
+
+struct compressed_entry *compressed_cache_table[COMPRESSED_CACHE_BUCKETS];
+struct compressed_entry *compressed_cache_lru_head;
+struct compressed_entry *compressed_cache_lru_tail;
+long compressed_cache_bytes;
+long compressed_cache_original_bytes; // what the same files take up uncompressed
+pthread_mutex_t compressed_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct compressed_entry *compressed_cache_queue; // files this thread has to compress
+
+unsigned long compressed_cache_gzip_hits; // sent as they are, compressed
+unsigned long compressed_cache_inflated; // decompressed back into the file cache
+unsigned long compressed_cache_incompressible;
+
+/*
+  `void compressed_cache_queue_entry(struct file_cache_entry *entry)` queues a file that's leaving
+  the file cache to be compressed.  Takes `file_cache_lock` for granted.
+*/
+void compressed_cache_queue_entry(struct file_cache_entry *entry) {
+  struct compressed_entry *queued = calloc(1, sizeof(struct compressed_entry));
+
+  if (queued == NULL || (queued->path = strdup(entry->path)) == NULL) {
+    free(queued);
+    return;
+  }
+  queued->hash = entry->hash;
+  queued->device = entry->device;
+  queued->inode = entry->inode;
+  queued->size = entry->size;
+  queued->modified = entry->modified;
+  queued->source = entry->response;
+  __atomic_fetch_add(&queued->source->refs, 1, __ATOMIC_RELAXED);
+  queued->hash_next = compressed_cache_queue;
+  compressed_cache_queue = queued;
+}
+
+void compressed_cache_free(struct compressed_entry *entry) {
+  if (entry->response != NULL)
+    cached_response_release(entry->response);
+  if (entry->source != NULL)
+    cached_response_release(entry->source);
+  free(entry->path);
+  free(entry);
+}
+
+// The functions below take `compressed_cache_lock` for granted.
+
+void compressed_cache_lru_unlink(struct compressed_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else compressed_cache_lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else compressed_cache_lru_tail = entry->lru_prev;
+}
+
+void compressed_cache_lru_push(struct compressed_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = compressed_cache_lru_head;
+  if (compressed_cache_lru_head) compressed_cache_lru_head->lru_prev = entry;
+  else compressed_cache_lru_tail = entry;
+  compressed_cache_lru_head = entry;
+}
+
+// `void compressed_cache_remove(struct compressed_entry *entry)` takes `entry` out, without freeing it.
+void compressed_cache_remove(struct compressed_entry *entry) {
+  struct compressed_entry **link = &compressed_cache_table[entry->hash % COMPRESSED_CACHE_BUCKETS];
+
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  compressed_cache_lru_unlink(entry);
+  compressed_cache_bytes -= entry->response->length;
+  compressed_cache_original_bytes -= entry->size;
+}
+
+/*
+  `void compressed_cache_drain(void)` compresses the files this thread has queued, and puts those
+  worth keeping in the compressed tier.  Call it without holding `file_cache_lock`.
+*/
+void compressed_cache_drain(void) {
+  struct compressed_entry *entry;
+  struct compressed_entry *old;
+  struct compressed_entry **bucket;
+  struct cached_response *response;
+  z_stream stream;
+  unsigned char *buffer;
+  long head_length = sizeof(GZIP_HEADER) - 1;
+  long bound;
+  long compressed;
+
+  while ((entry = compressed_cache_queue) != NULL) {
+    compressed_cache_queue = entry->hash_next;
+
+    // Gzip the body into a buffer big enough for the worst case, then copy it out at its real size.
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, COMPRESSED_CACHE_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      compressed_cache_free(entry);
+      continue;
+    }
+    bound = deflateBound(&stream, entry->size);
+    if ((buffer = malloc(bound)) == NULL) {
+      deflateEnd(&stream);
+      compressed_cache_free(entry);
+      continue;
+    }
+    stream.next_in = (unsigned char *) entry->source->data + entry->source->head_length;
+    stream.avail_in = entry->size;
+    stream.next_out = buffer;
+    stream.avail_out = bound;
+    compressed = deflate(&stream, Z_FINISH) == Z_STREAM_END ? (long) stream.total_out : -1;
+    deflateEnd(&stream);
+
+    if (compressed == -1 || compressed * 100 > entry->size * (100 - COMPRESSED_CACHE_MIN_SAVING)
+        || (response = cache_alloc(sizeof(struct cached_response) + head_length + compressed)) == NULL) {
+      if (compressed != -1)
+        __atomic_fetch_add(&compressed_cache_incompressible, 1, __ATOMIC_RELAXED);
+      free(buffer);
+      compressed_cache_free(entry);
+      continue;
+    }
+    response->refs = 1;
+    response->indexed = 0;
+    response->head_length = head_length;
+    response->length = head_length + compressed;
+    memcpy(response->data, GZIP_HEADER, head_length);
+    memcpy(response->data + head_length, buffer, compressed);
+    free(buffer);
+    cached_response_release(entry->source);
+    entry->source = NULL;
+    entry->response = response;
+
+    pthread_mutex_lock(&compressed_cache_lock);
+    bucket = &compressed_cache_table[entry->hash % COMPRESSED_CACHE_BUCKETS];
+    for (old = *bucket; old != NULL && strcmp(old->path, entry->path) != 0; old = old->hash_next)
+      ;
+    if (old != NULL) {
+      compressed_cache_remove(old);
+      compressed_cache_free(old);
+    }
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    compressed_cache_lru_push(entry);
+    compressed_cache_bytes += response->length;
+    compressed_cache_original_bytes += entry->size;
+    while (compressed_cache_bytes > COMPRESSED_CACHE_SIZE && (old = compressed_cache_lru_tail) != entry) {
+      compressed_cache_remove(old);
+      compressed_cache_free(old);
+    }
+    pthread_mutex_unlock(&compressed_cache_lock);
+  }
+}
+
+/*
+  `struct cached_response *compressed_cache_lookup(char *path, struct stat *info, int accepts_gzip)`
+  looks for the file at `path`, as `fstat` describes it in `info`, in the compressed tier.  If it's
+  there, and the client `accepts_gzip`, returns the compressed response; otherwise it takes it out
+  of the tier and returns it decompressed, ready to go in the file cache.  Returns NULL if it isn't
+  there.  Release what it returns with `cached_response_release`.
+*/
+struct cached_response *compressed_cache_lookup(char *path, struct stat *info, int accepts_gzip) {
+  struct compressed_entry *entry;
+  struct cached_response *response = NULL;
+  z_stream stream;
+  long head_length = FILE_HEAD_LENGTH;
+  int inflated;
+
+  pthread_mutex_lock(&compressed_cache_lock);
+  for (entry = compressed_cache_table[hash_string(path) % COMPRESSED_CACHE_BUCKETS];
+       entry != NULL && strcmp(entry->path, path) != 0; entry = entry->hash_next)
+    ;
+  if (entry == NULL || entry->device != info->st_dev || entry->inode != info->st_ino || entry->size != info->st_size
+      || entry->modified.tv_sec != info->st_mtim.tv_sec || entry->modified.tv_nsec != info->st_mtim.tv_nsec) {
+    // Missing, or out of date: then it's no use to anyone.
+    if (entry != NULL) {
+      compressed_cache_remove(entry);
+      compressed_cache_free(entry);
+    }
+    pthread_mutex_unlock(&compressed_cache_lock);
+    return NULL;
+  }
+  if (accepts_gzip) {
+    response = entry->response;
+    __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+    compressed_cache_lru_unlink(entry);
+    compressed_cache_lru_push(entry);
+    pthread_mutex_unlock(&compressed_cache_lock);
+    __atomic_fetch_add(&compressed_cache_gzip_hits, 1, __ATOMIC_RELAXED);
+    return response;
+  }
+  compressed_cache_remove(entry);
+  pthread_mutex_unlock(&compressed_cache_lock);
+
+  // Decompressing takes a while, so it's done with the entry out of the tier and the lock let go.
+  if ((response = cache_alloc(sizeof(struct cached_response) + head_length + entry->size)) != NULL) {
+    response->refs = 1;
+    response->indexed = 0;
+    response->entries = NULL;
+    response->head_length = head_length;
+    response->length = head_length + entry->size;
+
+    memset(&stream, 0, sizeof(stream));
+    inflated = inflateInit2(&stream, 15 + 16) == Z_OK;
+    if (inflated) {
+      stream.next_in = (unsigned char *) entry->response->data + entry->response->head_length;
+      stream.avail_in = entry->response->length - entry->response->head_length;
+      stream.next_out = (unsigned char *) response->data + head_length;
+      stream.avail_out = entry->size;
+      inflated = inflate(&stream, Z_FINISH) == Z_STREAM_END && (long) stream.total_out == entry->size;
+      inflateEnd(&stream);
+    }
+    if (!inflated) {
+      cache_free(response);
+      response = NULL;
+    } else {
+      file_response_head(response);
+      __atomic_fetch_add(&compressed_cache_inflated, 1, __ATOMIC_RELAXED);
+    }
+  }
+  compressed_cache_free(entry);
+  return response;
+}
+
+/*
+  `void file_cache_add(struct file_cache_entry *entry)` puts a new entry, already in the hash table,
+  into the window, and makes room for it: the window's least recently used entries become candidates
+  for the main part, where each one either displaces less popular entries, or is thrown out.
+*/
+void file_cache_add(struct file_cache_entry *entry) {
+  struct file_cache_entry *candidate;
+  struct file_cache_entry *victim;
+  long chances = file_cache_entries;
+
+  file_cache_sketch_add(entry->hash, 1);
+  file_cache_share(entry);
+  file_cache_lru_push(entry, FILE_CACHE_IN_WINDOW);
+  file_cache_bytes += entry->charge;
+  file_cache_entries++;
+
+  while (file_cache_lists[FILE_CACHE_IN_WINDOW].bytes > FILE_CACHE_WINDOW) {
+    candidate = file_cache_lists[FILE_CACHE_IN_WINDOW].tail;
+    file_cache_lru_unlink(candidate);
+    if (chances > 0 && file_cache_take_used(candidate)) {
+      chances--;
+      file_cache_lru_push(candidate, FILE_CACHE_IN_WINDOW);
+      continue;
+    }
+    file_cache_lru_push(candidate, FILE_CACHE_ON_PROBATION);
+
+    while (file_cache_lists[FILE_CACHE_ON_PROBATION].bytes + file_cache_lists[FILE_CACHE_PROTECTED_LIST].bytes
+           > FILE_CACHE_MAIN) {
+      victim = file_cache_probation_victim(&chances);
+      if (victim == NULL || victim == candidate) {
+        file_cache_remove(candidate);
+        break;
+      }
+      if (file_cache_frequency(candidate) > file_cache_frequency(victim)) {
+        compressed_cache_queue_entry(victim);
+        file_cache_remove(victim);
+      } else {
+        if (file_cache_frequency(candidate) > 1)
+          compressed_cache_queue_entry(candidate);
+        file_cache_remove(candidate);
+        file_cache_rejections++;
+        break;
+      }
+    }
+  }
+}
+
+/*
+  `int file_cache_contains(char *path)` says whether the file at `path` is in the file cache,
+  without checking whether it has changed since.
+*/
+int file_cache_contains(char *path) {
+  struct file_cache_entry *entry;
+
+  pthread_mutex_lock(&file_cache_lock);
+  entry = file_cache_table[hash_string(path) % FILE_CACHE_BUCKETS];
+  while (entry != NULL && strcmp(entry->path, path) != 0)
+    entry = entry->hash_next;
+  pthread_mutex_unlock(&file_cache_lock);
+  return entry != NULL;
+}
+
+/*
+  Single-flight loading.  When a new release goes out, thousands of requests can miss the file cache
+  for the same file at the same moment, and each would read it from disk into a copy of its own,
+  only for all but one of the copies to be thrown away.  Instead, the first to miss registers a
+  `file_load` for the path, and reads the file; the others find the load and wait for it to finish,
+  then share what it read.
+
+  Loads in progress are few, one per thread reading a file at most, so they're kept in one list,
+  guarded by `file_cache_lock`.  Each has a condition of its own to wait on, so finishing one load
+  doesn't wake the threads waiting for the others.  The loader hands its response to the waiters
+  directly rather than leaving them to find it in the cache: W-TinyLFU may well not keep a file
+  that's new.  A waiter that fstat'd a different version of the file than the loader did, or whose
+  loader failed, starts over.
+
+  Workers answer many connections from one thread, and must not sit waiting for someone else's disk
+  read any more than for their own, so a worker that finds a load in progress hands the request to
+  the disk I/O pool; it's the pool's threads that wait.
+*/
+struct file_load {
+  char *path;
+  struct stat info; // the file as the loader found it
+  struct cached_response *response; // what it read, once `done`; NULL if it couldn't
+  int done;
+  int waiters;
+  pthread_cond_t loaded;
+  struct file_load *next;
+};
+
+struct file_load *file_loads;
+unsigned long file_cache_coalesced; // misses that waited for another thread's read
+
+// `void file_load_free(struct file_load *load)` frees a finished load, once nobody's waiting on it.
+void file_load_free(struct file_load *load) {
+  if (load->response != NULL)
+    cached_response_release(load->response);
+  pthread_cond_destroy(&load->loaded);
+  free(load->path);
+  free(load);
+}
+
+/*
+  `void file_load_finish(struct file_load *load, struct cached_response *response)` ends `load`,
+  handing `response` (which may be NULL) to whoever's waiting.  Takes `file_cache_lock` for granted.
+*/
+void file_load_finish(struct file_load *load, struct cached_response *response) {
+  struct file_load **link = &file_loads;
+
+  while (*link != load)
+    link = &(*link)->next;
+  *link = load->next;
+
+  if (response != NULL)
+    __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+  load->response = response;
+  load->done = 1;
+  pthread_cond_broadcast(&load->loaded);
+  if (load->waiters == 0)
+    file_load_free(load);
+}
+
+/*
+  `void file_load_end(struct file_load *load, struct cached_response *response)` is
+  `file_load_finish` for callers that don't hold `file_cache_lock`.  `load` may be NULL.
+*/
+void file_load_end(struct file_load *load, struct cached_response *response) {
+  if (load == NULL)
+    return;
+  pthread_mutex_lock(&file_cache_lock);
+  file_load_finish(load, response);
+  pthread_mutex_unlock(&file_cache_lock);
+}
+
+/*
+  `struct cached_response *file_cache_find(char *path, unsigned long hash, struct stat *info)`
+  returns the cached response for the file at `path`, whose `hash_string` is `hash`, if the cache
+  has it as `fstat` describes it in `info`, or NULL.  It doesn't take `file_cache_lock`, but can be
+  called holding it.
+*/
+struct cached_response *file_cache_find(char *path, unsigned long hash, struct stat *info) {
+  struct file_cache_entry *entry;
+  struct cached_response *response = NULL;
+
+  epoch_enter();
+  for (entry = __atomic_load_n(&file_cache_table[hash % FILE_CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+       entry != NULL && strcmp(entry->path, path) != 0; entry = __atomic_load_n(&entry->hash_next, __ATOMIC_ACQUIRE))
+    ;
+  if (entry != NULL && entry->device == info->st_dev && entry->inode == info->st_ino && entry->size == info->st_size
+      && entry->modified.tv_sec == info->st_mtim.tv_sec && entry->modified.tv_nsec == info->st_mtim.tv_nsec) {
+    response = entry->response;
+    __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->hits, 1, __ATOMIC_RELAXED);
+    // Only write the flag if it isn't set, so the entry's cache line isn't dirtied on every hit.
+    if (!__atomic_load_n(&entry->used, __ATOMIC_RELAXED))
+      __atomic_store_n(&entry->used, 1, __ATOMIC_RELAXED);
+  }
+  epoch_exit();
+  return response;
+}
+
+/*
+  `struct cached_response *file_cache_read(int fd, struct stat *info, int *would_block)` reads the
+  file open as `fd`, which `fstat` describes in `info`, into a new response, or returns NULL if it
+  can't.  `would_block` is as for `file_cache_lookup`.
+*/
+struct cached_response *file_cache_read(int fd, struct stat *info, int *would_block) {
+  struct cached_response *response;
+  struct iovec iov;
+  long head_length = FILE_HEAD_LENGTH;
+  long done;
+  ssize_t read_bytes;
+
+  if ((response = cache_alloc(sizeof(struct cached_response) + head_length + info->st_size)) == NULL)
+    return NULL;
+  response->refs = 1;
+  response->indexed = 0;
+  response->entries = NULL;
+  response->head_length = head_length;
+  response->length = head_length + info->st_size;
+  for (done = 0; done < info->st_size; done += read_bytes) {
+    /*
+      `preadv2` with RWF_NOWAIT reads only what's in the page cache.  It returns what it could
+      (maybe less than asked), and fails with EAGAIN if it can't read anything without the disk.
+      Filesystems that don't support it fail with EOPNOTSUPP; we can't tell, so assume the worst.
+    */
+    if (would_block != NULL) {
+      iov.iov_base = response->data + head_length + done;
+      iov.iov_len = info->st_size - done;
+      read_bytes = preadv2(fd, &iov, 1, done, RWF_NOWAIT);
+    } else {
+      read_bytes = pread(fd, response->data + head_length + done, info->st_size - done, done);
+    }
+    if (read_bytes == -1 && errno == EINTR) {
+      read_bytes = 0;
+    } else if (read_bytes <= 0) {
+      if (read_bytes == -1 && would_block != NULL && (errno == EAGAIN || errno == EOPNOTSUPP))
+        *would_block = 1;
+      cache_free(response);
+      return NULL;
+    }
+  }
+  file_response_head(response);
+  __atomic_fetch_add(&file_cache_misses, 1, __ATOMIC_RELAXED);
+  return response;
+}
+
+/*
+  `struct cached_response *file_cache_lookup(char *path, int fd, int accepts_gzip, int *would_block)`
+  returns the cached response for the file at `path`, which is open as `fd`, reading it into the
+  cache first if it isn't there (or has changed since).  If the client `accepts_gzip`, that can be
+  a gzipped response from the compressed tier.  Release it with `cached_response_release` when done.
+  Returns NULL if the file is too big for the cache, or can't be read: then it has to be sent from
+  disk.
+
+  If `would_block` isn't NULL, the file is only read if it's all in the kernel's page cache, so
+  reading it can't block on the disk.  If it isn't, or another thread is reading it already,
+  `*would_block` is set and NULL is returned.
+*/
+struct cached_response *file_cache_lookup(char *path, int fd, int accepts_gzip, int *would_block) {
+  struct stat info;
+  struct file_cache_entry *entry;
+  struct file_cache_entry *old;
+  struct file_cache_entry **bucket;
+  struct cached_response *response;
+  struct file_load *load;
+  unsigned long hash;
+  int shared;
+
+  if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size > FILE_CACHE_MAX_OBJECT)
+    return NULL;
+  hash = hash_string(path);
+  bucket = &file_cache_table[hash % FILE_CACHE_BUCKETS];
+
+  while (1) {
+    if ((response = file_cache_find(path, hash, &info)) != NULL) {
+      __atomic_fetch_add(&file_cache_hits, 1, __ATOMIC_RELAXED);
+      return response;
+    }
+
+    pthread_mutex_lock(&file_cache_lock);
+    for (load = file_loads; load != NULL && strcmp(load->path, path) != 0; load = load->next)
+      ;
+    if (load == NULL) {
+      // Nobody's reading it.  Unless someone just finished, it's up to us.
+      if ((response = file_cache_find(path, hash, &info)) != NULL) {
+        pthread_mutex_unlock(&file_cache_lock);
+        __atomic_fetch_add(&file_cache_hits, 1, __ATOMIC_RELAXED);
+        return response;
+      }
+      // Without the memory to tell the others, we read it anyway; they'll read it too.
+      if ((load = calloc(1, sizeof(struct file_load))) != NULL && (load->path = strdup(path)) != NULL) {
+        load->info = info;
+        pthread_cond_init(&load->loaded, NULL);
+        load->next = file_loads;
+        file_loads = load;
+      } else {
+        free(load);
+        load = NULL;
+      }
+      pthread_mutex_unlock(&file_cache_lock);
+      break;
+    }
+
+    if (would_block != NULL) {
+      pthread_mutex_unlock(&file_cache_lock);
+      *would_block = 1;
+      return NULL;
+    }
+    load->waiters++;
+    while (!load->done)
+      pthread_cond_wait(&load->loaded, &file_cache_lock);
+    response = load->response;
+    if (response != NULL && load->info.st_dev == info.st_dev && load->info.st_ino == info.st_ino
+        && load->info.st_size == info.st_size && load->info.st_mtim.tv_sec == info.st_mtim.tv_sec
+        && load->info.st_mtim.tv_nsec == info.st_mtim.tv_nsec)
+      __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED);
+    else
+      response = NULL;
+    if (--load->waiters == 0)
+      file_load_free(load);
+    pthread_mutex_unlock(&file_cache_lock);
+    if (response != NULL) {
+      __atomic_fetch_add(&file_cache_coalesced, 1, __ATOMIC_RELAXED);
+      return response;
+    }
+  }
+
+  // Not cached, or the file has changed.  It may still be in the compressed tier; if not, read it.
+  response = compressed_cache_lookup(path, &info, accepts_gzip);
+  if (response != NULL && accepts_gzip) {
+    // The waiters might not take gzip; they'll find it in the compressed tier themselves.
+    file_load_end(load, NULL);
+    return response;
+  }
+  if (response == NULL && (response = file_cache_read(fd, &info, would_block)) == NULL) {
+    file_load_end(load, NULL);
+    return NULL;
+  }
+
+  // If the same bytes are in the cache under another path, use those instead.
+  response = content_table_share(response, &shared);
+
+  // Publish it, in place of any older copy.  If there's no memory for an entry, just don't cache.
+  entry = calloc(1, sizeof(struct file_cache_entry));
+  if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+    free(entry);
+    file_load_end(load, response);
+    return response;
+  }
+  entry->hash = hash;
+  entry->device = info.st_dev;
+  entry->inode = info.st_ino;
+  entry->size = info.st_size;
+  entry->modified = info.st_mtim;
+  entry->response = response;
+  __atomic_fetch_add(&response->refs, 1, __ATOMIC_RELAXED); // the cache's reference, besides the caller's
+
+  pthread_mutex_lock(&file_cache_lock);
+  for (old = *bucket; old != NULL && strcmp(old->path, path) != 0; old = old->hash_next)
+    ;
+  entry->hash_next = *bucket;
+  __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+  if (old != NULL)
+    file_cache_remove(old);
+  file_cache_add(entry);
+  if (load != NULL)
+    file_load_finish(load, response);
+  pthread_mutex_unlock(&file_cache_lock);
+  compressed_cache_drain();
+
+  return response;
+}
+
+/*
+  Streaming.  A file too big for the file cache is sent a chunk at a time, through STREAM_BUFFERS
+  buffers of STREAM_CHUNK bytes that each worker allocates once and reuses for every file.  However
+  big the file, a worker never holds more of it in memory than that.
+
+  The buffers take turns, so that reading from disk overlaps with sending to the network.  While one
+  buffer is being sent, the client's socket fills up whenever the client (or the network) is slower
+  than we are.  Rather than wait for it to drain, the worker uses the time to read the next chunk
+  into a free buffer; the kernel meanwhile keeps transmitting what's queued on the socket.  Only
+  when every buffer is full and the socket still is, does the worker wait.
+
+  Files over STREAM_PROTECT_SIZE are kept out of the kernel's page cache.  Otherwise one download of
+  a huge file would fill the page cache with it, pushing out the small, popular files everyone else
+  is asking for, and those would have to come from disk again.  So for a huge file we tell the
+  kernel we'll read it sequentially (POSIX_FADV_SEQUENTIAL: read ahead further, and don't bother
+  keeping what's behind us), and every STREAM_DROP_WINDOW bytes we tell it we're done with what we've
+  sent so far (POSIX_FADV_DONTNEED), which it then drops.  What's been sent is in the socket's
+  buffers by then, so we won't read it again.
+*/
+#define STREAM_CHUNK (64 * 1024)
+#define STREAM_BUFFERS 2
+#define STREAM_PROTECT_SIZE (64L * 1024 * 1024)
+#define STREAM_DROP_WINDOW (4L * 1024 * 1024)
+
+unsigned long stream_dropped_bytes; // bytes of huge files dropped from the page cache after sending
+
+__thread char *stream_buffers; // STREAM_BUFFERS * STREAM_CHUNK bytes, allocated on first use
+
+/*
+  `int stream_file(int client_sock_fd, int fd, long start, long end)` sends the file open as `fd` to
+  `client_sock_fd`, from byte `start` up to `end`, or to its current end on disk if `end` is -1,
+  using the worker's stream buffers.  Returns 1 on success and 0 on failure.
+*/
+int stream_file(int client_sock_fd, int fd, long start, long end) {
+  long lengths[STREAM_BUFFERS]; // bytes read into each buffer
+  long offset = start; // where in the file the next read starts
+  long sent = 0; // bytes of the current buffer sent so far
+  long done = start; // where in the file what's been sent in full ends
+  long dropped = start; // where what's been dropped from the page cache ends
+  long wanted;
+  struct stat info;
+  int protect;
+  int current = 0; // the buffer being sent
+  int filled = 0; // buffers with data in them, starting at `current`
+  int at_end = 0;
+  int next;
+  ssize_t result;
+
+  if (stream_buffers == NULL && (stream_buffers = malloc(STREAM_BUFFERS * STREAM_CHUNK)) == NULL)
+    return 0;
+
+  protect = fstat(fd, &info) == 0 && info.st_size > STREAM_PROTECT_SIZE;
+  if (protect)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (1) {
+    /*
+      Keep the free buffers filled, so that a chunk is ready whenever the socket has room.  After
+      the first, these reads mostly happen while the socket is full and the kernel is sending.
+    */
+    if (filled < STREAM_BUFFERS && !at_end) {
+      next = (current + filled) % STREAM_BUFFERS;
+      wanted = end != -1 && end - offset < STREAM_CHUNK ? end - offset : STREAM_CHUNK;
+      result = wanted > 0 ? pread(fd, stream_buffers + next * STREAM_CHUNK, wanted, offset) : 0;
+      if (result == -1 && errno == EINTR)
+        continue;
+      if (result == -1)
+        return 0;
+      if (result == 0) {
+        at_end = 1;
+      } else {
+        lengths[next] = result;
+        offset += result;
+        filled++;
+      }
+    }
+
+    if (filled == 0) {
+      // Everything has been read and sent.  Drop whatever's left of a huge file, too.
+      if (protect && offset > dropped) {
+        posix_fadvise(fd, dropped, 0, POSIX_FADV_DONTNEED);
+        __atomic_fetch_add(&stream_dropped_bytes, offset - dropped, __ATOMIC_RELAXED);
+      }
+      return 1;
+    }
+
+    result = send(client_sock_fd, stream_buffers + current * STREAM_CHUNK + sent, lengths[current] - sent,
+                  MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Socket full.  Go and read ahead if we can; if not, wait for the socket to drain.
+      if ((filled < STREAM_BUFFERS && !at_end) || wait_for_socket(client_sock_fd, POLLOUT))
+        continue;
+      return 0;
+    }
+    if (result == -1)
+      return 0;
+
+    sent += result;
+    if (sent == lengths[current]) {
+      // This buffer's done.  It's free for the next read.
+      done += lengths[current];
+      current = (current + 1) % STREAM_BUFFERS;
+      filled--;
+      sent = 0;
+
+      if (protect && done - dropped >= STREAM_DROP_WINDOW) {
+        posix_fadvise(fd, dropped, done - dropped, POSIX_FADV_DONTNEED);
+        __atomic_fetch_add(&stream_dropped_bytes, done - dropped, __ATOMIC_RELAXED);
+        dropped = done;
+      }
+    }
+  }
+}
+
+/*
+  `int stream_start_resident(int fd, long start)` says whether the first stream buffers' worth of
+  the file open as `fd`, from byte `start` on, is in the page cache, so that `stream_file` can start
+  sending it without waiting for the disk.  It maps that much of the file into memory, which reads
+  nothing, and asks `mincore` which of the mapped pages are resident.
+*/
+int stream_start_resident(int fd, long start) {
+  unsigned char pages[STREAM_BUFFERS * STREAM_CHUNK / 4096]; // one per page, and pages are 4KB or more
+  long page_size = sysconf(_SC_PAGESIZE);
+  long length = STREAM_BUFFERS * STREAM_CHUNK;
+  long aligned = start / page_size * page_size; // a mapping has to start on a page
+  long page;
+  struct stat info;
+  void *mapping;
+  int resident;
+
+  if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode))
+    return 0;
+  if (info.st_size - aligned < length)
+    length = info.st_size - aligned;
+  if (length <= 0)
+    return 1;
+
+  if ((mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, aligned)) == MAP_FAILED)
+    return 0;
+  resident = mincore(mapping, length, pages) == 0;
+  for (page = 0; resident && page < (length + page_size - 1) / page_size; page++)
+    resident = pages[page] & 1;
+  munmap(mapping, length);
+  return resident;
+}
+
+/*
+  Ranges.  A client that only wants part of a file, such as a video player seeking, or one reading
+  a big archive's index, sends a "Range" header, and gets a 206 with just those bytes.  A range
+  that starts past the end of the file gets a 416.
+*/
+#define PARTIAL_HEADER "HTTP/1.0 206 Partial Content\r\nServer: Minimal Web Server\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n"
+#define RANGE_NOT_SATISFIABLE_HEADER "HTTP/1.0 416 Range Not Satisfiable\r\nServer: Minimal Web Server\r\nContent-Range: bytes */%ld\r\n\r\n"
+
+unsigned long range_requests;
+
+/*
+  `int resolve_range(struct request_headers *headers, long size, long *start, long *end)` works out
+  which bytes of a file of `size` bytes the request asks for: from `*start` up to `*end`.  Returns 1
+  for a range, 0 if it wants the whole file, and -1 if its range is past the end of the file.
+*/
+int resolve_range(struct request_headers *headers, long size, long *start, long *end) {
+  if (!headers->has_range)
+    return 0;
+  if (headers->range_first == -1) {
+    if (headers->range_last == 0 || size == 0)
+      return -1;
+    *start = headers->range_last < size ? size - headers->range_last : 0;
+    *end = size;
+    return 1;
+  }
+  if (headers->range_first >= size)
+    return -1;
+  *start = headers->range_first;
+  *end = headers->range_last == -1 || headers->range_last >= size ? size : headers->range_last + 1;
+  return 1;
+}
+
+/*
+  The block cache.  Files too big for the file cache are sent from disk every time, which suits
+  downloads, but not clients that ask for the same few ranges of a huge file over and over: its
+  header, its index, the start of a video.  So ranges of those files are served from a cache of
+  BLOCK_SIZE blocks instead, each keyed by the file (device, inode, size and modification time, so
+  a changed file's blocks are never used) and its place in it.  A range needs the blocks it
+  overlaps; those that aren't cached are read, and the rest come from memory.  The head and the
+  pieces of each block are then sent with one `sendmsg` (scatter-gather), without copying them
+  together first.
+
+  Only ranges of up to BLOCK_CACHE_MAX_RANGE bytes go through it.  Longer ones, and requests for
+  the whole file, are streamed from disk as before, so a download doesn't fill the cache with
+  blocks nobody will ask for again.  The cache throws out its least recently used blocks once they
+  add up to more than BLOCK_CACHE_SIZE bytes.  It's only used for range requests, so a mutex does.
+*/
+#define BLOCK_SIZE (256 * 1024)
+#define BLOCK_CACHE_SIZE (256 * 1024 * 1024)
+#define BLOCK_CACHE_BUCKETS 8192
+#define BLOCK_CACHE_MAX_RANGE (16 * BLOCK_SIZE) // longer ranges are streamed from disk
+#define BLOCK_RANGE_BLOCKS (BLOCK_CACHE_MAX_RANGE / BLOCK_SIZE + 1) // the most a range can overlap
+
+struct block_entry {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+  long index; // which block of the file: its first byte is at `index * BLOCK_SIZE`
+  unsigned long hash; // `block_hash` of the file and `index`
+  struct cached_response *block; // the block's bytes, with no head
+  struct block_entry *hash_next;
+  struct block_entry *lru_prev; // towards the most recently used
+  struct block_entry *lru_next; // towards the least recently used
+};
+
+struct block_entry *block_cache_table[BLOCK_CACHE_BUCKETS];
+struct block_entry *block_cache_lru_head;
+struct block_entry *block_cache_lru_tail;
+long block_cache_bytes;
+pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long block_cache_sent; // blocks ranges were sent from
+unsigned long block_cache_reads; // blocks read from disk
+
+// `unsigned long block_hash(struct stat *info, long index)` hashes block `index` of the file `info` describes.
+unsigned long block_hash(struct stat *info, long index) {
+  return ((unsigned long) info->st_ino * 0x9E3779B97F4A7C15UL) ^ (info->st_dev + index * 0xC2B2AE3D27D4EB4FUL);
+}
+
+// The functions below take `block_cache_lock` for granted.
+
+void block_cache_lru_unlink(struct block_entry *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else block_cache_lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else block_cache_lru_tail = entry->lru_prev;
+}
+
+void block_cache_lru_push(struct block_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = block_cache_lru_head;
+  if (block_cache_lru_head) block_cache_lru_head->lru_prev = entry;
+  else block_cache_lru_tail = entry;
+  block_cache_lru_head = entry;
+}
+
+struct block_entry *block_cache_find(struct stat *info, long index) {
+  struct block_entry *entry = block_cache_table[block_hash(info, index) % BLOCK_CACHE_BUCKETS];
+
+  while (entry != NULL && !(entry->index == index && entry->inode == info->st_ino && entry->device == info->st_dev
+                            && entry->size == info->st_size && entry->modified.tv_sec == info->st_mtim.tv_sec
+                            && entry->modified.tv_nsec == info->st_mtim.tv_nsec))
+    entry = entry->hash_next;
+  return entry;
+}
+
+// `void block_cache_evict(void)` throws out the least recently used block.
+void block_cache_evict(void) {
+  struct block_entry *entry = block_cache_lru_tail;
+  struct block_entry **link = &block_cache_table[entry->hash % BLOCK_CACHE_BUCKETS];
+
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  block_cache_lru_unlink(entry);
+  block_cache_bytes -= entry->block->length;
+  cached_response_release(entry->block);
+  free(entry);
+}
+
+/*
+  `struct cached_response *block_cache_get(int fd, struct stat *info, long index, int *would_block)`
+  returns block `index` of the file open as `fd`, which `fstat` describes in `info`, from the block
+  cache, or reads it in first.  Release it with `cached_response_release`.  Returns NULL if it can't
+  be read; `would_block` is as for `file_cache_lookup`.
+*/
+struct cached_response *block_cache_get(int fd, struct stat *info, long index, int *would_block) {
+  struct block_entry *entry;
+  struct block_entry **bucket = &block_cache_table[block_hash(info, index) % BLOCK_CACHE_BUCKETS];
+  struct cached_response *block;
+  struct iovec iov;
+  long length = info->st_size - index * BLOCK_SIZE < BLOCK_SIZE ? info->st_size - index * BLOCK_SIZE : BLOCK_SIZE;
+  long done;
+  ssize_t read_bytes;
+
+  pthread_mutex_lock(&block_cache_lock);
+  if ((entry = block_cache_find(info, index)) != NULL) {
+    block = entry->block;
+    __atomic_fetch_add(&block->refs, 1, __ATOMIC_RELAXED);
+    block_cache_lru_unlink(entry);
+    block_cache_lru_push(entry);
+    pthread_mutex_unlock(&block_cache_lock);
+    return block;
+  }
+  pthread_mutex_unlock(&block_cache_lock);
+
+  if ((block = cache_alloc(sizeof(struct cached_response) + length)) == NULL)
+    return NULL;
+  block->refs = 1;
+  block->indexed = 0;
+  block->head_length = 0;
+  block->length = length;
+  for (done = 0; done < length; done += read_bytes) {
+    if (would_block != NULL) {
+      iov.iov_base = block->data + done;
+      iov.iov_len = length - done;
+      read_bytes = preadv2(fd, &iov, 1, index * BLOCK_SIZE + done, RWF_NOWAIT);
+    } else {
+      read_bytes = pread(fd, block->data + done, length - done, index * BLOCK_SIZE + done);
+    }
+    if (read_bytes == -1 && errno == EINTR) {
+      read_bytes = 0;
+    } else if (read_bytes <= 0) {
+      if (read_bytes == -1 && would_block != NULL && (errno == EAGAIN || errno == EOPNOTSUPP))
+        *would_block = 1;
+      cache_free(block);
+      return NULL;
+    }
+  }
+  __atomic_fetch_add(&block_cache_reads, 1, __ATOMIC_RELAXED);
+
+  // Cache it, unless someone beat us to it.  Without the memory for an entry, just don't.
+  pthread_mutex_lock(&block_cache_lock);
+  if (block_cache_find(info, index) == NULL && (entry = malloc(sizeof(struct block_entry))) != NULL) {
+    entry->device = info->st_dev;
+    entry->inode = info->st_ino;
+    entry->size = info->st_size;
+    entry->modified = info->st_mtim;
+    entry->index = index;
+    entry->hash = block_hash(info, index);
+    entry->block = block;
+    __atomic_fetch_add(&block->refs, 1, __ATOMIC_RELAXED); // the cache's
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    block_cache_lru_push(entry);
+    block_cache_bytes += length;
+    while (block_cache_bytes > BLOCK_CACHE_SIZE && block_cache_lru_tail != entry)
+      block_cache_evict();
+  }
+  pthread_mutex_unlock(&block_cache_lock);
+  return block;
+}
+
+/*
+  `int block_cache_range(int fd, long start, long end)` says whether the request for bytes `start`
+  up to `end` of the file open as `fd` is one for the block cache.
+*/
+int block_cache_range(int fd, long start, long end) {
+  struct stat info;
+
+  return end - start <= BLOCK_CACHE_MAX_RANGE && fstat(fd, &info) == 0 && S_ISREG(info.st_mode)
+         && info.st_size > FILE_CACHE_MAX_OBJECT;
+}
+
+/*
+  `int block_cache_fill(int fd, long start, long end, int *would_block)` makes sure the blocks
+  holding bytes `start` up to `end` of the file open as `fd` are in the block cache.  Returns 1 if
+  they are, and 0 if one couldn't be read; `would_block` is as for `file_cache_lookup`.
+*/
+int block_cache_fill(int fd, long start, long end, int *would_block) {
+  struct cached_response *block;
+  struct stat info;
+  long index;
+
+  if (fstat(fd, &info) == -1)
+    return 0;
+  for (index = start / BLOCK_SIZE; index * BLOCK_SIZE < end; index++) {
+    if ((block = block_cache_get(fd, &info, index, would_block)) == NULL)
+      return 0;
+    cached_response_release(block);
+  }
+  return 1;
+}
+
+/*
+  `int block_cache_chain(struct buffer_chain *chain, int fd, struct stat *info, long start, long end)`
+  appends bytes `start` up to `end` of the file open as `fd`, which `fstat` describes in `info`, to
+  `chain`, from the block cache, reading the blocks that aren't there yet.  Returns 0, leaving
+  `chain` as it was, if one can't be read.
+*/
+int block_cache_chain(struct buffer_chain *chain, int fd, struct stat *info, long start, long end) {
+  struct cached_response *block;
+  int count = chain->count;
+  long index;
+  long from;
+  long to;
+
+  for (index = start / BLOCK_SIZE; index * BLOCK_SIZE < end; index++) {
+    if ((block = block_cache_get(fd, info, index, NULL)) == NULL) {
+      chain_truncate(chain, count);
+      return 0;
+    }
+    from = index * BLOCK_SIZE < start ? start - index * BLOCK_SIZE : 0;
+    to = index * BLOCK_SIZE + block->length > end ? end - index * BLOCK_SIZE : block->length;
+    chain_add_memory(chain, block->data + from, to - from, block);
+    cached_response_release(block);
+    __atomic_fetch_add(&block_cache_sent, 1, __ATOMIC_RELAXED);
+  }
+  return 1;
+}
+
+/*
+  `int large_file_ready(int fd, struct request_headers *headers, int wait)` gets what a GET for the
+  file open as `fd`, too big for the file cache, needs from disk: the blocks of a range for the
+  block cache, or the start of what's to be streamed.  Without `wait`, it does only what won't wait
+  for the disk, and returns 0 if there's more to do; with it, it does everything (streaming just
+  gets a head start) and returns 1.
+*/
+int large_file_ready(int fd, struct request_headers *headers, int wait) {
+  struct stat info;
+  long start = 0;
+  long end = -1;
+  int would_block = 0;
+
+  if (fstat(fd, &info) == 0 && resolve_range(headers, info.st_size, &start, &end) == 1
+      && block_cache_range(fd, start, end))
+    return block_cache_fill(fd, start, end, wait ? NULL : &would_block) || !would_block;
+  if (wait) {
+    readahead(fd, start, STREAM_BUFFERS * STREAM_CHUNK);
+    return 1;
+  }
+  return stream_start_resident(fd, start);
+}
+
+/*
+  `void send_file_response(int client_sock_fd, int is_head, int resource_fd, struct cached_response *response,
+                           struct request_headers *headers)`
+  answers a GET or HEAD for a static file.  `resource_fd` is the file, opened (or -1 if there's no
+  such file), and `response` is the file from the file cache, if it's in there (NULL for a HEAD, or
+  a file too big for the cache).  Closes the one and releases the other.  `headers` are the
+  request's, for its range, if it has one.
+
+  The response goes out as a buffer chain: its head, then the file from the file cache, the block
+  cache, or, with `sendfile`, the page cache.  Files over STREAM_PROTECT_SIZE are streamed instead,
+  to keep them out of the page cache.
+*/
+void send_file_response(int client_sock_fd, int is_head, int resource_fd, struct cached_response *response,
+                        struct request_headers *headers) {
+  struct buffer_chain chain;
+  struct stat info;
+  char head[256];
+  long size = 0;
+  long start = 0;
+  long end = -1;
+  int range = 0;
+  int stream = 0;
+
+  if (resource_fd == -1) {
+    // If file is not found
+    printf("404 Not Found\n");
+    send_string(client_sock_fd, NOT_FOUND_RESPONSE);
+    return;
+  }
+
+  // File is found.  Work out which part of it is wanted: the size is the cached copy's, if there is one.
+  if (!is_head && (response != NULL || fstat(resource_fd, &info) == 0)) {
+    size = response != NULL ? response->length - response->head_length : info.st_size;
+    range = resolve_range(headers, size, &start, &end);
+    if (range != 0)
+      __atomic_fetch_add(&range_requests, 1, __ATOMIC_RELAXED);
+    if (range == 0)
+      end = size;
+  }
+
+  chain_init(&chain);
+  if (is_head || (response == NULL && range == 0)) {
+    // the header, then (unless it's a HEAD request) the file from disk
+    chain_add_memory(&chain, OK_HEADER, sizeof(OK_HEADER) - 1, NULL);
+  } else if (range == -1) {
+    chain_add_memory(&chain, head, snprintf(head, sizeof(head), RANGE_NOT_SATISFIABLE_HEADER, size), NULL);
+  } else if (range == 1) {
+    chain_add_memory(&chain, head, snprintf(head, sizeof(head), PARTIAL_HEADER, start, end - 1, size), NULL);
+  }
+
+  if (is_head || range == -1) {
+    // nothing more to send
+  } else if (response != NULL) {
+    // the file (or the part of it that's wanted), straight from the file cache
+    if (range == 1)
+      chain_add_memory(&chain, response->data + response->head_length + start, end - start, response);
+    else
+      chain_add_memory(&chain, response->data, response->length, response);
+  } else if (range == 1 && block_cache_range(resource_fd, start, end)
+             && block_cache_chain(&chain, resource_fd, &info, start, end)) {
+    // part of a file too big for the file cache: from the block cache (or, if a block can't be read, as below)
+  } else if (end != -1 && size <= STREAM_PROTECT_SIZE) {
+    // the file (or the part of it that's wanted) from the page cache, with `sendfile`
+    chain_add_file(&chain, resource_fd, start, end - start);
+  } else {
+    // too big to let into the page cache: stream it from disk
+    stream = 1;
+  }
+
+  if (chain_send(client_sock_fd, &chain) && stream)
+    stream_file(client_sock_fd, resource_fd, start, range == 1 ? end : -1);
+
+  if (response != NULL)
+    cached_response_release(response);
+  // close the file
+  close(resource_fd);
+}
+
+/*
+  The disk I/O pool.  Opening and reading a file that isn't in memory means waiting for the disk,
+  possibly for milliseconds.  A worker waiting for the disk isn't serving anything else, and since
+  every worker has a queue of connections of its own (see `open_listener`), the whole queue waits.
+
+  So a request for a file that would have to come from disk is handed to a pool of DISK_IO_THREADS
+  threads, which do the reading: into the file cache, or, for a file too big for it, its first
+  chunks into the kernel's page cache so that streaming gets off to a quick start.  The worker
+  meanwhile goes back to its other connections.  When a job is done, the pool thread pushes it onto its worker's `completed` list
+  and wakes the worker through the worker's eventfd (a file descriptor that's just a counter, which
+  epoll can watch next to the listening socket), and the worker sends the response.
+
+  Handing a job over costs two context switches and a trip through the queue, which is a waste for
+  a file that's in memory already.  Most are, in the file cache or at least in the page cache, so
+  `process_request` first tries to read the file without blocking (`preadv2` with RWF_NOWAIT, or
+  `mincore` for a file too big for the file cache), and only hands it over if that fails.  A
+  request that finds DISK_IO_QUEUE jobs already waiting isn't handed over either; the worker does
+  its own I/O then.  The `disk_io_inline` and `disk_io_offloaded` counters show the split.
+*/
+#define DISK_IO_THREADS 4
+#define DISK_IO_QUEUE 1024 // jobs waiting for a pool thread, beyond which workers do their own I/O
+
+struct disk_job {
+  int client_sock_fd;
+  int is_head;
+  char resource[500]; // the file's path
+  int resource_fd; // ... and the file
+  struct request_headers headers;
+  struct cached_response *response; // the file from the file cache, if it went in there
+  struct worker_context *owner; // the worker to hand the job back to
+  struct disk_job *next;
+};
+
+struct disk_job *disk_queue_head;
+struct disk_job *disk_queue_tail;
+int disk_queue_length;
+pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t disk_queue_ready = PTHREAD_COND_INITIALIZER;
+
+unsigned long disk_io_inline; // static file requests served without the pool
+unsigned long disk_io_offloaded; // static file requests the pool did the disk I/O for
+
+/*
+  `int disk_io_submit(struct worker_context *owner, int client_sock_fd, int is_head, char *resource,
+                      int resource_fd, struct request_headers *headers)`
+  hands a GET or HEAD for the file at `resource`, open as `resource_fd`, with request `headers`, to
+  the disk I/O pool, on behalf of worker `owner`.  Returns 1 if the pool took it, or 0 if the
+  caller has to serve the request itself.
+*/
+int disk_io_submit(struct worker_context *owner, int client_sock_fd, int is_head, char *resource, int resource_fd,
+                   struct request_headers *headers) {
+  struct disk_job *job;
+
+  if (owner == NULL || owner->completion_fd == -1 || (job = malloc(sizeof(struct disk_job))) == NULL)
+    return 0;
+  job->client_sock_fd = client_sock_fd;
+  job->is_head = is_head;
+  strcpy(job->resource, resource);
+  job->resource_fd = resource_fd;
+  job->headers = *headers;
+  job->response = NULL;
+  job->owner = owner;
+  job->next = NULL;
+
+  pthread_mutex_lock(&disk_queue_lock);
+  if (disk_queue_length >= DISK_IO_QUEUE) {
+    pthread_mutex_unlock(&disk_queue_lock);
+    free(job);
+    return 0;
+  }
+  if (disk_queue_tail != NULL)
+    disk_queue_tail->next = job;
+  else
+    disk_queue_head = job;
+  disk_queue_tail = job;
+  disk_queue_length++;
+  pthread_cond_signal(&disk_queue_ready);
+  pthread_mutex_unlock(&disk_queue_lock);
+  return 1;
+}
+
+/*
+  `void *disk_io_thread(void *unused)` is a disk I/O pool thread: it takes jobs off the queue, does
+  their blocking I/O, and hands them back to their workers, forever.
+*/
+void *disk_io_thread(void *unused) {
+  struct disk_job *job;
+  uint64_t one = 1;
+
+  (void) unused;
+  while (1) {
+    pthread_mutex_lock(&disk_queue_lock);
+    while (disk_queue_head == NULL)
+      pthread_cond_wait(&disk_queue_ready, &disk_queue_lock);
+    job = disk_queue_head;
+    if ((disk_queue_head = job->next) == NULL)
+      disk_queue_tail = NULL;
+    disk_queue_length--;
+    pthread_mutex_unlock(&disk_queue_lock);
+
+    // Act on the worker's behalf, so that what goes in the cache comes from its node's arena.
+    current_worker = job->owner;
+
+    if (!job->is_head) {
+      job->response = file_cache_lookup(job->resource, job->resource_fd,
+                                        job->headers.accepts_gzip && !job->headers.has_range, NULL);
+      if (job->response == NULL)
+        large_file_ready(job->resource_fd, &job->headers, 1);
+    }
+    __atomic_fetch_add(&disk_io_offloaded, 1, __ATOMIC_RELAXED);
+
+    /*
+      Push the job onto the worker's `completed` list.  Several pool threads may be pushing at
+      once, so it's done with compare-and-swap: set `next` to the head we saw, and swap in the job
+      only if the head is still that one; otherwise `next` is updated to the new head, try again.
+    */
+    job->next = __atomic_load_n(&job->owner->completed, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&job->owner->completed, &job->next, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    write(job->owner->completion_fd, &one, sizeof(one));
+  }
+  return NULL;
+}
+
+/*
+  `void finish_disk_jobs(struct worker_context *context)` sends the responses for all the jobs the
+  disk I/O pool has handed back to the worker `context`, and closes their connections.
+*/
+void finish_disk_jobs(struct worker_context *context) {
+  struct disk_job *job;
+  struct disk_job *next;
+  uint64_t count;
+
+  // Reset the eventfd's counter, then take the whole list at once.
+  read(context->completion_fd, &count, sizeof(count));
+  for (job = __atomic_exchange_n(&context->completed, NULL, __ATOMIC_ACQUIRE); job != NULL; job = next) {
+    next = job->next;
+    send_file_response(job->client_sock_fd, job->is_head, job->resource_fd, job->response, &job->headers);
+    shutdown(job->client_sock_fd, SHUT_RDWR);
+    close(job->client_sock_fd);
+    free(job);
+  }
+}
+
+/*
+  The cache snapshot.  Filling a big file cache from disk after every restart takes minutes, so on
+  SIGINT or SIGTERM the server writes the file cache out to CACHE_SNAPSHOT before exiting, and at
+  startup maps it back in.  The snapshot has a header, then one record per cached file, most
+  popular first: the file's path, the inode, size and modification time its entry was made
+  for, how many hits it had and, with CACHE_SNAPSHOT_BODIES, its cached response, byte for byte
+  as it sits in memory.
+
+  That last part is what makes restoring fast.  The file is mapped (privately, so our changes to it
+  stay ours) and the file cache entries point straight at the responses in the mapping; nothing is
+  copied, and the kernel reads the pages in as they're needed, or ahead of time after an
+  MADV_WILLNEED.  Nothing is checked against the files at startup either: every entry is checked by
+  `fstat` on its first request anyway, like any other entry, and a file that has changed since
+  the snapshot is read again then.
+
+  Without bodies, the snapshot is just an index: its paths are handed to the warm-up, which loads
+  them from disk, most popular first, like a WARMUP_LIST.
+
+  The snapshot is written to a new file that then replaces the old one, so a crash while writing it
+  leaves the previous one, and the old snapshot's mapping stays valid while the new one is written.
+  A snapshot written by a build with different structures is ignored.
+*/
+#define CACHE_SNAPSHOT "./mws_cache.snapshot"
+#ifndef CACHE_SNAPSHOT_BODIES
+#define CACHE_SNAPSHOT_BODIES 1 // 0 keeps just the index, and loads the files from disk at startup
+#endif
+#define SNAPSHOT_MAGIC "MWSCACH1"
+#define SNAPSHOT_ALIGN(length) (((length) + 7) & ~7L) // records and responses are 8-byte aligned
+
+struct snapshot_header {
+  char magic[8];
+  uint64_t records;
+  uint64_t record_size;   // sizeof(struct snapshot_record) in the build that wrote it
+  uint64_t response_size; // and sizeof(struct cached_response)
+};
+
+struct snapshot_record {
+  uint64_t length; // bytes in the whole record, path and response included
+  uint64_t device;
+  uint64_t inode;
+  int64_t size;
+  int64_t modified_seconds;
+  int64_t modified_nanoseconds;
+  uint64_t hits;
+  uint32_t path_length; // bytes in `path`, its '\0' and padding included
+  uint32_t has_body;
+  char path[]; // followed by a `struct cached_response` if `has_body`
+};
+
+char **cache_snapshot_paths; // files in an index-only snapshot, left for the warm-up to load
+long cache_snapshot_path_count;
+long cache_snapshot_bytes; // bytes of responses restored from the snapshot
+unsigned long cache_snapshot_files;
+
+/*
+  `int cache_snapshot_save(void)` writes the file cache to CACHE_SNAPSHOT.  Returns 0 on success,
+  or -1 on failure.  The file cache is locked meanwhile; we're about to exit anyway.
+*/
+int cache_snapshot_save(void) {
+  static const char padding[8];
+  // The most popular first: the protected list, then the newest files, then those on probation.
+  static const int lists[3] = { FILE_CACHE_PROTECTED_LIST, FILE_CACHE_IN_WINDOW, FILE_CACHE_ON_PROBATION };
+  struct snapshot_header header = { SNAPSHOT_MAGIC, 0, sizeof(struct snapshot_record), sizeof(struct cached_response) };
+  struct snapshot_record record;
+  struct cached_response response_head;
+  struct file_cache_entry *entry;
+  FILE *snapshot;
+  long path_length;
+  long body_length;
+  int failed;
+  int i;
+
+  if ((snapshot = fopen(CACHE_SNAPSHOT ".new", "w")) == NULL)
+    return -1;
+
+  pthread_mutex_lock(&file_cache_lock);
+  header.records = file_cache_entries;
+  fwrite(&header, sizeof(header), 1, snapshot);
+
+  for (i = 0; i < 3; i++) {
+    for (entry = file_cache_lists[lists[i]].head; entry != NULL; entry = entry->lru_next) {
+      path_length = strlen(entry->path) + 1;
+      body_length = CACHE_SNAPSHOT_BODIES ? sizeof(struct cached_response) + entry->response->length : 0;
+
+      memset(&record, 0, sizeof(record));
+      record.path_length = SNAPSHOT_ALIGN(path_length);
+      record.has_body = CACHE_SNAPSHOT_BODIES;
+      record.length = sizeof(record) + record.path_length + SNAPSHOT_ALIGN(body_length);
+      record.device = entry->device;
+      record.inode = entry->inode;
+      record.size = entry->size;
+      record.modified_seconds = entry->modified.tv_sec;
+      record.modified_nanoseconds = entry->modified.tv_nsec;
+      record.hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+      fwrite(&record, sizeof(record), 1, snapshot);
+      fwrite(entry->path, 1, path_length, snapshot);
+      fwrite(padding, 1, record.path_length - path_length, snapshot);
+
+      if (record.has_body) {
+        response_head = *entry->response;
+        response_head.refs = 0;
+        response_head.indexed = 0;
+        response_head.entries = NULL;
+        response_head.content_next = NULL;
+        fwrite(&response_head, sizeof(response_head), 1, snapshot);
+        fwrite(entry->response->data, 1, entry->response->length, snapshot);
+        fwrite(padding, 1, SNAPSHOT_ALIGN(body_length) - body_length, snapshot);
+      }
+    }
+  }
+  pthread_mutex_unlock(&file_cache_lock);
+
+  failed = ferror(snapshot);
+  if (fclose(snapshot) != 0 || failed || rename(CACHE_SNAPSHOT ".new", CACHE_SNAPSHOT) == -1) {
+    unlink(CACHE_SNAPSHOT ".new");
+    return -1;
+  }
+  printf("Saved %lu files to the cache snapshot\n", header.records);
+  return 0;
+}
+
+/*
+  `void cache_snapshot_restore(void)` maps CACHE_SNAPSHOT, if there is one, and fills the file cache
+  from it, up to FILE_CACHE_SIZE.  It runs before the workers start, so it has the cache (and its
+  lock) to itself.
+*/
+void cache_snapshot_restore(void) {
+  struct snapshot_header *header;
+  struct snapshot_record *record;
+  struct cached_response *response;
+  struct file_cache_entry *entry;
+  struct file_cache_entry **bucket;
+  struct stat info;
+  char *snapshot;
+  long offset = sizeof(struct snapshot_header);
+  uint64_t i;
+  long charge;
+  int list;
+  int shared;
+  int fd;
+
+  if ((fd = open(CACHE_SNAPSHOT, O_RDONLY)) == -1)
+    return;
+  if (fstat(fd, &info) == -1 || info.st_size < (off_t) sizeof(struct snapshot_header)) {
+    close(fd);
+    return;
+  }
+  snapshot = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (snapshot == MAP_FAILED)
+    return;
+
+  header = (struct snapshot_header *) snapshot;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+      || header->record_size != sizeof(struct snapshot_record)
+      || header->response_size != sizeof(struct cached_response)
+      || header->records > (uint64_t) info.st_size / sizeof(struct snapshot_record)) {
+    printf("%s", "Ignoring a cache snapshot from another build\n");
+    munmap(snapshot, info.st_size);
+    return;
+  }
+  if ((cache_snapshot_paths = calloc(header->records + 1, sizeof(char *))) == NULL) {
+    munmap(snapshot, info.st_size);
+    return;
+  }
+  madvise(snapshot, info.st_size, MADV_WILLNEED);
+  cache_snapshot_base = snapshot; // from here on, `cache_free` knows to leave the snapshot's responses alone
+  cache_snapshot_size = info.st_size;
+
+  // Check each record fits in the file before trusting it: the snapshot may have been cut short.
+  for (i = 0; i < header->records; i++, offset += record->length) {
+    record = (struct snapshot_record *) (snapshot + offset);
+    if (offset + (long) sizeof(struct snapshot_record) > info.st_size
+        || record->length > (uint64_t) (info.st_size - offset) || record->length % 8 != 0
+        || record->length < sizeof(struct snapshot_record) + record->path_length
+        || record->path_length == 0 || record->path[record->path_length - 1] != '\0')
+      break;
+
+    if (!record->has_body) {
+      cache_snapshot_paths[cache_snapshot_path_count++] = record->path;
+      continue;
+    }
+    response = (struct cached_response *) (record->path + record->path_length);
+    if (record->length - sizeof(struct snapshot_record) - record->path_length
+          < sizeof(struct cached_response) + (uint64_t) response->length
+        || response->head_length > response->length)
+      break;
+    response->refs = 1; // the cache's
+    response->indexed = 0;
+    response->entries = NULL;
+    response = content_table_share(response, &shared);
+    charge = response->entries != NULL ? (long) (sizeof(struct file_cache_entry) + strlen(record->path) + 1)
+                                       : response->length;
+
+    // The snapshot lists the most popular first: fill the protected list, then probation, then the window.
+    if (file_cache_lists[FILE_CACHE_PROTECTED_LIST].bytes + charge <= FILE_CACHE_PROTECTED)
+      list = FILE_CACHE_PROTECTED_LIST;
+    else if (file_cache_lists[FILE_CACHE_ON_PROBATION].bytes + file_cache_lists[FILE_CACHE_PROTECTED_LIST].bytes
+             + charge <= FILE_CACHE_MAIN)
+      list = FILE_CACHE_ON_PROBATION;
+    else if (file_cache_lists[FILE_CACHE_IN_WINDOW].bytes + charge <= FILE_CACHE_WINDOW)
+      list = FILE_CACHE_IN_WINDOW;
+    else
+      list = -1;
+
+    if (list == -1) {
+      cached_response_release(response);
+      continue;
+    }
+    if ((entry = calloc(1, sizeof(struct file_cache_entry))) == NULL
+        || (entry->path = strdup(record->path)) == NULL) {
+      free(entry);
+      cached_response_release(response);
+      break;
+    }
+    entry->hash = hash_string(entry->path);
+    entry->device = record->device;
+    entry->inode = record->inode;
+    entry->size = record->size;
+    entry->modified.tv_sec = record->modified_seconds;
+    entry->modified.tv_nsec = record->modified_nanoseconds;
+    entry->hits = record->hits;
+    entry->response = response;
+    file_cache_share(entry);
+
+    bucket = &file_cache_table[entry->hash % FILE_CACHE_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    file_cache_lru_append(entry, list);
+    file_cache_bytes += charge;
+    file_cache_entries++;
+    cache_snapshot_bytes += charge;
+    cache_snapshot_files++;
+  }
+
+  printf("Restored %lu files (%ld bytes) from the cache snapshot, %ld more to load\n", cache_snapshot_files,
+         cache_snapshot_bytes, cache_snapshot_path_count);
+}
+
+/*
+  `void *save_on_exit(void *signals)` is the thread that waits for one of `signals` (which every
+  other thread blocks), saves the cache snapshot and exits.
+*/
+void *save_on_exit(void *signals) {
+  int signal_number;
+
+  sigwait((sigset_t *) signals, &signal_number);
+  if (cache_snapshot_save() == -1)
+    printf("%s", "Could not save the cache snapshot\n");
+  exit(0);
+}
+
+/*
+  Warm-up.  Right after a restart the file cache is empty, and the page cache may be as well, so
+  for the first minutes most requests go to disk.  If WARMUP_LIST exists, it lists urls, most
+  popular first, one per line; from an access log, for instance:
+
+      awk '{ print $7 }' access.log | sort | uniq -c | sort -rn | awk '{ print $2 }' > mws_warmup.txt
+
+  At startup, a thread works through it, after any files an index-only cache snapshot left to load,
+  while the workers are already taking requests:
+
+  1) It asks the kernel to start reading every file on the list (POSIX_FADV_WILLNEED), without
+     waiting for any of them, so the disk works on them all at once instead of one at a time.
+     For a file too big for the file cache, just the start, which is all streaming needs.
+  2) It loads the files into the file cache, most popular first, stopping when the next one
+     wouldn't fit: past that point every file loaded would evict a more popular one.
+
+  Whether or not there was a list, the thread then samples the file cache's hit rate every
+  WARMUP_SAMPLE_MILLISECONDS, and reports how long after startup it first reached
+  WARMUP_TARGET_HIT_RATE percent.
+*/
+#define WARMUP_LIST "./mws_warmup.txt"
+#define WARMUP_TARGET_HIT_RATE 90 // percent of file cache lookups
+#define WARMUP_SAMPLE_MILLISECONDS 250
+#define WARMUP_MIN_SAMPLE 100 // lookups a sample needs before its hit rate counts
+
+long server_started; // `now_microseconds` when `main` started
+unsigned long warmup_files; // files the warm-up loaded into the file cache
+long warmup_milliseconds; // how long the warm-up took
+long target_hit_rate_milliseconds; // how long after startup the target hit rate was reached, or 0
+
+/*
+  `int warmup_file(char *resource, int load, long *budget)` warms up the file at `resource`:
+  prefetches it if `load` is 0, or loads it into the file cache if `load` is 1, as long as its size
+  fits into what's left of `*budget`, which it then takes the size from.  Returns 0 once the budget
+  has run out, and 1 otherwise.
+*/
+int warmup_file(char *resource, int load, long *budget) {
+  struct stat info;
+  struct cached_response *response;
+  int fd;
+
+  if ((fd = open(resource, O_RDONLY, 0)) == -1)
+    return 1;
+  if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return 1;
+  }
+
+  if (info.st_size > FILE_CACHE_MAX_OBJECT) {
+    // Too big for the file cache: the kernel may as well have the start ready.
+    if (!load)
+      posix_fadvise(fd, 0, STREAM_BUFFERS * STREAM_CHUNK, POSIX_FADV_WILLNEED);
+    close(fd);
+    return 1;
+  }
+  if (info.st_size + (long) FILE_HEAD_LENGTH > *budget) {
+    close(fd);
+    return 0;
+  }
+  *budget -= info.st_size + FILE_HEAD_LENGTH; // what its entry will be charged
+
+  if (!load) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  } else if ((response = file_cache_lookup(resource, fd, 0, NULL)) != NULL) {
+    cached_response_release(response);
+    warmup_files++;
+  }
+  close(fd);
+  return 1;
+}
+
+/*
+  `void *warmup(void *unused)` is the warm-up thread.  It warms up the files the cache snapshot left
+  and those on WARMUP_LIST, then watches the file cache's hit rate until it reaches the target.
+*/
+void *warmup(void *unused) {
+  FILE *list;
+  char url[500];
+  char resource[500];
+  long budget;
+  long i;
+  int more;
+  long hits;
+  long lookups;
+  long last_hits = 0;
+  long last_lookups = 0;
+  int load;
+  struct timespec pause = { WARMUP_SAMPLE_MILLISECONDS / 1000, WARMUP_SAMPLE_MILLISECONDS % 1000 * 1000000L };
+
+  (void) unused;
+  list = fopen(WARMUP_LIST, "r");
+  if (list != NULL || cache_snapshot_path_count > 0) {
+    // Two passes over the files: prefetch everything, then load it.
+    for (load = 0; load <= 1; load++) {
+      budget = FILE_CACHE_SIZE - cache_snapshot_bytes;
+      more = 1;
+      for (i = 0; i < cache_snapshot_path_count && more; i++)
+        more = warmup_file(cache_snapshot_paths[i], load, &budget);
+      if (list != NULL)
+        rewind(list);
+      while (list != NULL && more && fgets(url, sizeof(url), list) != NULL) {
+        url[strcspn(url, "\r\n")] = '\0';
+        if (url[0] != '/' || strlen(url) + strlen(WEBROOT) + strlen("index.html") >= sizeof(resource))
+          continue;
+        resource_path(url, resource);
+        more = warmup_file(resource, load, &budget);
+      }
+    }
+    if (list != NULL)
+      fclose(list);
+    warmup_milliseconds = (now_microseconds() - server_started) / 1000;
+    printf("Warmed up %lu files in %ld ms\n", warmup_files, warmup_milliseconds);
+  }
+
+  while (1) {
+    nanosleep(&pause, NULL);
+    hits = __atomic_load_n(&file_cache_hits, __ATOMIC_RELAXED);
+    lookups = hits + __atomic_load_n(&file_cache_misses, __ATOMIC_RELAXED);
+    if (lookups - last_lookups >= WARMUP_MIN_SAMPLE
+        && (hits - last_hits) * 100 >= WARMUP_TARGET_HIT_RATE * (lookups - last_lookups)) {
+      target_hit_rate_milliseconds = (now_microseconds() - server_started) / 1000;
+      printf("File cache hit rate reached %d%% %ld ms after startup\n", WARMUP_TARGET_HIT_RATE,
+             target_hit_rate_milliseconds);
+      return NULL;
+    }
+    last_hits = hits;
+    last_lookups = lookups;
+  }
+}
+
+/*
+  FastCGI.  A request whose url starts with one of the `fastcgi_routes` prefixes is handed to a
+  FastCGI application listening on a Unix socket, and the application's output is streamed back to
+  the client.  FastCGI (https://fastcgi-archives.github.io/FastCGI_Specification.html) is CGI
+  without the process per request: the application stays running and requests reach it as
+  "records" over a socket.
+
+  We keep up to `connections` persistent connections open to each application.  Every record
+  carries a request id, so one connection can carry up to `max_requests` requests at the same time;
+  their response records come back interleaved and we sort them out by id.  When every slot on
+  every connection is taken, a request waits up to FASTCGI_WAIT_SECONDS for one to free up and then
+  gets a 503.  That's our back-pressure: a busy application sees a bounded number of requests, not
+  a growing pile of them.
+
+  One of the workers waiting on a connection reads its records for all of them.  It only hands
+  each request its output, into a buffer of the request's; the request's own worker sends it to its
+  client.  That way the reader never writes to a client socket it doesn't own.  Records for a
+  request whose client has fallen FASTCGI_OUTPUT_SIZE behind have to wait for it, and everybody
+  else's records wait behind them; so a client that keeps the reader waiting for more than
+  FASTCGI_STALL_MILLISECONDS all told is dropped, rather than holding up everybody else's.
+*/
+struct fastcgi_route {
+  char *prefix;      // url prefix that selects this route, e.g. "/fcgi/"
+  char *socket_path; // where the application listens
+  int connections;   // persistent connections to keep to it, at most FASTCGI_MAX_CONNECTIONS
+  int max_requests;  // requests in flight on each connection, at most FASTCGI_MAX_REQUESTS
+                     // (1 for applications that can't multiplex)
+};
+
+struct fastcgi_route fastcgi_routes[] = {
+  { "/fcgi/", "/tmp/mws_fastcgi.sock", 4, 8 },
+};
+
+#define FASTCGI_ROUTE_COUNT (int) (sizeof(fastcgi_routes) / sizeof(fastcgi_routes[0]))
+#define FASTCGI_MAX_CONNECTIONS 16
+#define FASTCGI_MAX_REQUESTS 16
+#define FASTCGI_WAIT_SECONDS 5 // how long a request waits for a free slot before giving up
+#define FASTCGI_TIMEOUT_SECONDS 10 // give up on an application that goes quiet for this long
+#define FASTCGI_HEADER_SIZE 8192 // room for the application's response headers
+#define FASTCGI_PARAMS_SIZE 4096 // room for the CGI variables we send with each request
+#define FASTCGI_RECORD_SIZE (65535 + 255) // the biggest record: 16-bit content length, 8-bit padding
+#define FASTCGI_OUTPUT_SIZE (256 * 1024) // a request's output waiting to be sent; at least one record's
+#define FASTCGI_STALL_MILLISECONDS 1000 // how long the reader waits for a slow client before dropping it
+
+// Record types and flags from the FastCGI specification.
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+/*
+  One request in flight.  It lives on the stack of the worker whose client asked for it.  The
+  reader only touches `done`, `dropped` and the output, and only under `fastcgi_lock`; the rest is
+  the worker's own.
+*/
+struct fastcgi_inflight {
+  int client_sock_fd;
+  int is_head;
+  int done;      // the application sent FCGI_END_REQUEST, or the connection broke
+  int dropped;   // the client fell too far behind: the rest of the output is thrown away
+  int head_sent; // the response head has gone to the client, so it's too late for a 502
+  int bad;       // the application's output couldn't be turned into a response
+  int header_length;
+  int output_length;
+  long stalled; // microseconds the reader has waited for room in `output`
+  char *output; // FASTCGI_OUTPUT_SIZE bytes for FCGI_STDOUT the reader has handed over, not yet sent
+  char header[FASTCGI_HEADER_SIZE]; // the application's headers, held back until they're complete
+};
+
+struct fastcgi_connection {
+  int fd;          // -1 while not connected
+  int initialized; // `fd` and `write_lock` have been set up
+  int broken;      // the connection failed; it's closed once its requests have all let go of it
+  int reading;     // a worker is reading records off this connection for everybody
+  int active;      // requests in flight
+  pthread_mutex_t write_lock; // a request's records must go out whole, not interleaved with another's
+  struct fastcgi_inflight *requests[FASTCGI_MAX_REQUESTS + 1]; // by request id; id 0 is reserved
+  char record[FASTCGI_RECORD_SIZE]; // only touched by the reading worker
+};
+
+struct fastcgi_connection fastcgi_connections[FASTCGI_ROUTE_COUNT][FASTCGI_MAX_CONNECTIONS];
+
+// Guards the connections' bookkeeping, though not their sockets or record buffers.
+pthread_mutex_t fastcgi_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fastcgi_changed = PTHREAD_COND_INITIALIZER;
+
+unsigned long fastcgi_requests;
+unsigned long fastcgi_waits;    // requests that had to wait for a free slot
+unsigned long fastcgi_rejected; // requests that waited too long and got a 503
+unsigned long fastcgi_dropped;  // requests whose client was too slow to keep up with the application
+
+/*
+  `int find_fastcgi_route(char *url)` returns the index of the route whose prefix `url` starts with,
+  or -1 if there isn't one.
+*/
+int find_fastcgi_route(char *url) {
+  int i;
+  for (i = 0; i < FASTCGI_ROUTE_COUNT; i++) {
+    if (strncmp(url, fastcgi_routes[i].prefix, strlen(fastcgi_routes[i].prefix)) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+  `int recv_all(int sock_fd, void *buffer, long length)` receives exactly `length` bytes into
+  `buffer`.  Returns 1 on success and 0 if the connection ended or failed first.
+*/
+int recv_all(int sock_fd, void *buffer, long length) {
+  long read_bytes;
+  while (length > 0) {
+    read_bytes = recv(sock_fd, buffer, length, 0);
+    if (read_bytes == -1 && errno == EINTR)
+      continue;
+    if (read_bytes <= 0)
+      return 0;
+    buffer = (char *) buffer + read_bytes;
+    length -= read_bytes;
+  }
+  return 1;
+}
+
+/*
+  `int fastcgi_connect(char *socket_path)` connects to the application at `socket_path`.  Returns
+  the socket, or -1 on failure.
+
+  A Unix socket is addressed by a file system path instead of an ip address and port, and it never
+  leaves the machine, so there are no packets or checksums involved.
+*/
+int fastcgi_connect(char *socket_path) {
+  struct sockaddr_un app_addr;
+  struct timeval timeout;
+  int app_fd;
+
+  if ((app_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  memset(&app_addr, 0, sizeof(app_addr));
+  app_addr.sun_family = AF_UNIX;
+  strncpy(app_addr.sun_path, socket_path, sizeof(app_addr.sun_path) - 1);
+
+  if (connect(app_fd, (struct sockaddr *)&app_addr, sizeof(app_addr)) == -1) {
+    close(app_fd);
+    return -1;
+  }
+
+  // Don't let an application that stops answering hang its requests forever.
+  timeout.tv_sec = FASTCGI_TIMEOUT_SECONDS;
+  timeout.tv_usec = 0;
+  setsockopt(app_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(app_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return app_fd;
+}
+
+/*
+  `void fastcgi_disconnect(struct fastcgi_connection *connection)` gives up on a connection that
+  failed: every request on it is finished (those that haven't started their response will get a
+  502), and it's closed as soon as nobody is using the socket.  Takes `fastcgi_lock` for granted.
+*/
+void fastcgi_disconnect(struct fastcgi_connection *connection) {
+  int i;
+
+  if (!connection->broken) {
+    connection->broken = 1;
+    shutdown(connection->fd, SHUT_RDWR);
+  }
+  for (i = 1; i <= FASTCGI_MAX_REQUESTS; i++) {
+    if (connection->requests[i] != NULL)
+      connection->requests[i]->done = 1;
+  }
+  if (connection->active == 0) {
+    close(connection->fd);
+    connection->fd = -1;
+    connection->broken = 0;
+  }
+}
+
+/*
+  `int fastcgi_record(unsigned char *buffer, int type, int request_id, int content_length)` writes
+  the 8 byte header of a record into `buffer` and returns its size.  Multi-byte numbers go big end
+  first ("B1" then "B0" in the specification).
+*/
+int fastcgi_record(unsigned char *buffer, int type, int request_id, int content_length) {
+  buffer[0] = FCGI_VERSION_1;
+  buffer[1] = type;
+  buffer[2] = request_id >> 8;
+  buffer[3] = request_id & 0xff;
+  buffer[4] = content_length >> 8;
+  buffer[5] = content_length & 0xff;
+  buffer[6] = 0; // padding length
+  buffer[7] = 0; // reserved
+  return 8;
+}
+
+/*
+  `int fastcgi_param(unsigned char *buffer, int length, char *name, char *value)` appends a
+  name-value pair to the FCGI_PARAMS content in `buffer`, which holds `length` bytes so far.  Each
+  length is one byte if it's under 128 and four bytes, with the top bit set, otherwise.  Returns the
+  new content length, or leaves it unchanged if the pair doesn't fit in FASTCGI_PARAMS_SIZE.
+*/
+int fastcgi_param(unsigned char *buffer, int length, char *name, char *value) {
+  int lengths[2] = { strlen(name), strlen(value) };
+  int i;
+
+  if (length + 8 + lengths[0] + lengths[1] > FASTCGI_PARAMS_SIZE)
+    return length;
+  for (i = 0; i < 2; i++) {
+    if (lengths[i] < 128) {
+      buffer[length++] = lengths[i];
+    } else {
+      buffer[length++] = (lengths[i] >> 24) | 0x80;
+      buffer[length++] = lengths[i] >> 16;
+      buffer[length++] = lengths[i] >> 8;
+      buffer[length++] = lengths[i];
+    }
+  }
+  memcpy(buffer + length, name, lengths[0]);
+  memcpy(buffer + length + lengths[0], value, lengths[1]);
+  return length + lengths[0] + lengths[1];
+}
+
+/*
+  `void fastcgi_send_head(struct fastcgi_inflight *inflight, int end)` turns the CGI headers in the
+  first `end` bytes of `inflight->header` into an HTTP response head and sends it.  CGI has no
+  status line; the application sends a "Status:" header instead, and no "Status:" means "200 OK".
+*/
+void fastcgi_send_head(struct fastcgi_inflight *inflight, int end) {
+  char head[FASTCGI_HEADER_SIZE + 128];
+  char headers[FASTCGI_HEADER_SIZE];
+  char status[128] = "200 OK";
+  char *line = inflight->header;
+  char *limit = inflight->header + end;
+  char *line_end;
+  char *value;
+  int headers_length = 0;
+  int length;
+
+  while (line < limit) {
+    line_end = memchr(line, '\n', limit - line);
+    length = (line_end ? line_end : limit) - line;
+    if (length > 0 && line[length - 1] == '\r')
+      length--;
+
+    if (length > 7 && strncasecmp(line, "Status:", 7) == 0) {
+      for (value = line + 7; *value == ' '; value++);
+      snprintf(status, sizeof(status), "%.*s", (int) (line + length - value), value);
+    } else if (length > 0) {
+      headers_length += snprintf(headers + headers_length, sizeof(headers) - headers_length, "%.*s\r\n", length, line);
+    }
+
+    if (line_end == NULL)
+      break;
+    line = line_end + 1;
+  }
+
+  length = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\n%.*s\r\n", status, headers_length, headers);
+  send_all(inflight->client_sock_fd, head, length);
+  inflight->head_sent = 1;
+}
+
+/*
+  `void fastcgi_stdout(struct fastcgi_inflight *inflight, char *data, int length)` handles an
+  FCGI_STDOUT record.  The headers are held back until they're complete; everything after them is
+  sent to the client as soon as it arrives, so the body is never buffered as a whole.
+*/
+void fastcgi_stdout(struct fastcgi_inflight *inflight, char *data, int length) {
+  char *end;
+  int copied;
+  int header_end;
+
+  if (inflight->bad)
+    return;
+
+  if (!inflight->head_sent) {
+    copied = length;
+    if (copied > FASTCGI_HEADER_SIZE - 1 - inflight->header_length)
+      copied = FASTCGI_HEADER_SIZE - 1 - inflight->header_length;
+    memcpy(inflight->header + inflight->header_length, data, copied);
+    inflight->header_length += copied;
+    inflight->header[inflight->header_length] = '\0';
+    data += copied;
+    length -= copied;
+
+    // The headers end with an empty line, though not every script bothers with the \r.
+    if ((end = strstr(inflight->header, "\r\n\r\n")) != NULL)
+      header_end = end + 4 - inflight->header;
+    else if ((end = strstr(inflight->header, "\n\n")) != NULL)
+      header_end = end + 2 - inflight->header;
+    else {
+      if (inflight->header_length == FASTCGI_HEADER_SIZE - 1)
+        inflight->bad = 1; // more headers than we have room for
+      return;
+    }
+
+    fastcgi_send_head(inflight, header_end);
+
+    // Whatever followed the headers in the buffer is the start of the body.
+    if (!inflight->is_head && inflight->header_length > header_end)
+      send_all(inflight->client_sock_fd, inflight->header + header_end, inflight->header_length - header_end);
+  }
+
+  if (!inflight->is_head && length > 0)
+    send_all(inflight->client_sock_fd, data, length);
+}
+
+/*
+  `int fastcgi_read_record(struct fastcgi_connection *connection)` reads one record from the
+  application and passes it on to the request it belongs to.  Only the worker that set
+  `connection->reading` may call this.  Returns 0 if the connection broke.
+
+  A request's worker may give up on it (the connection broke) and return whenever we don't hold
+  `fastcgi_lock`, so we look the request up afresh every time we take the lock.
+*/
+int fastcgi_read_record(struct fastcgi_connection *connection) {
+  struct fastcgi_inflight *inflight = NULL;
+  struct timespec deadline;
+  unsigned char header[8];
+  int request_id;
+  int content_length;
+  long started;
+
+  if (!recv_all(connection->fd, header, 8))
+    return 0;
+  request_id = header[2] << 8 | header[3];
+  content_length = header[4] << 8 | header[5];
+  if (!recv_all(connection->fd, connection->record, content_length + header[6]))
+    return 0;
+
+  // Records for request id 0 are about the connection itself, and nothing we asked about.
+  if (request_id < 1 || request_id > FASTCGI_MAX_REQUESTS)
+    return 1;
+
+  if (header[1] == FCGI_STDERR)
+    printf("FastCGI application says: %.*s\n", content_length, connection->record);
+
+  pthread_mutex_lock(&fastcgi_lock);
+  if (header[1] == FCGI_STDOUT) {
+    // Wait for the request's worker to make room for the output, while its client has time left.
+    while ((inflight = connection->requests[request_id]) != NULL && !inflight->dropped
+           && inflight->output_length + content_length > FASTCGI_OUTPUT_SIZE) {
+      if (inflight->stalled >= FASTCGI_STALL_MILLISECONDS * 1000L) {
+        inflight->dropped = 1;
+        __atomic_fetch_add(&fastcgi_dropped, 1, __ATOMIC_RELAXED);
+        break;
+      }
+      started = now_microseconds();
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (FASTCGI_STALL_MILLISECONDS * 1000L - inflight->stalled) * 1000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&fastcgi_changed, &fastcgi_lock, &deadline);
+      if ((inflight = connection->requests[request_id]) != NULL)
+        inflight->stalled += now_microseconds() - started;
+    }
+    if (inflight != NULL && !inflight->dropped) {
+      memcpy(inflight->output + inflight->output_length, connection->record, content_length);
+      inflight->output_length += content_length;
+    }
+  } else if (header[1] == FCGI_END_REQUEST && (inflight = connection->requests[request_id]) != NULL) {
+    inflight->done = 1;
+  }
+  pthread_mutex_unlock(&fastcgi_lock);
+  return 1;
+}
+
+/*
+  `void fastcgi_request(int client_sock_fd, char *request, char *url, char *client_ip, int route_index)`
+  runs the GET or HEAD for `url` through the FastCGI application of route `route_index` and streams
+  its response to the client.
+*/
+void fastcgi_request(int client_sock_fd, char *request, char *url, char *client_ip, int route_index) {
+  struct fastcgi_route *route = &fastcgi_routes[route_index];
+  struct fastcgi_connection *connection = NULL;
+  struct fastcgi_inflight inflight;
+  struct timespec deadline;
+  unsigned char records[FASTCGI_PARAMS_SIZE + 48];
+  char *buffers; // `inflight.output`, and a second buffer to send from while the reader fills it
+  char *sending;
+  int sending_length;
+  unsigned char *params = records + 24; // after the FCGI_BEGIN_REQUEST record and the FCGI_PARAMS header
+  char path[500];
+  char script_filename[600];
+  char port[8];
+  char *query;
+  int params_length = 0;
+  int records_length;
+  int request_id;
+  int waited = 0;
+  int sent;
+  int i;
+  char peek;
+
+  inflight.client_sock_fd = client_sock_fd;
+  inflight.is_head = strncmp(request, "HEAD ", 5) == 0;
+  inflight.done = inflight.dropped = inflight.head_sent = inflight.bad = 0;
+  inflight.header_length = inflight.output_length = 0;
+  inflight.stalled = 0;
+  if ((buffers = malloc(2 * FASTCGI_OUTPUT_SIZE)) == NULL) {
+    printf("503 FastCGI Application Busy\n");
+    send_string(client_sock_fd, BUSY_RESPONSE);
+    return;
+  }
+  inflight.output = buffers;
+
+  /*
+    Pick the connection with the fewest requests in flight, so the load spreads over the
+    application's processes.  If they're all full, wait for a slot to free up, up to a point.
+  */
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += FASTCGI_WAIT_SECONDS;
+
+  pthread_mutex_lock(&fastcgi_lock);
+  while (1) {
+    for (i = 0; i < route->connections; i++) {
+      struct fastcgi_connection *candidate = &fastcgi_connections[route_index][i];
+      if (!candidate->broken && candidate->active < route->max_requests
+          && (connection == NULL || candidate->active < connection->active))
+        connection = candidate;
+    }
+    if (connection != NULL)
+      break;
+    if (!waited)
+      __atomic_fetch_add(&fastcgi_waits, 1, __ATOMIC_RELAXED);
+    waited = 1;
+    if (pthread_cond_timedwait(&fastcgi_changed, &fastcgi_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  if (connection == NULL) {
+    pthread_mutex_unlock(&fastcgi_lock);
+    __atomic_fetch_add(&fastcgi_rejected, 1, __ATOMIC_RELAXED);
+    printf("503 FastCGI Application Busy\n");
+    send_string(client_sock_fd, BUSY_RESPONSE);
+    free(buffers);
+    return;
+  }
+
+  if (!connection->initialized) {
+    pthread_mutex_init(&connection->write_lock, NULL);
+    connection->fd = -1;
+    connection->initialized = 1;
+  }
+
+  // An idle connection may have been closed by the application since we last used it.
+  if (connection->fd != -1 && connection->active == 0
+      && recv(connection->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+    close(connection->fd);
+    connection->fd = -1;
+  }
+  if (connection->fd == -1 && (connection->fd = fastcgi_connect(route->socket_path)) == -1) {
+    pthread_mutex_unlock(&fastcgi_lock);
+    printf("502 Bad Gateway\n");
+    send_string(client_sock_fd, BAD_GATEWAY_RESPONSE);
+    free(buffers);
+    return;
+  }
+
+  for (request_id = 1; connection->requests[request_id] != NULL; request_id++);
+  connection->requests[request_id] = &inflight;
+  connection->active++;
+  pthread_mutex_unlock(&fastcgi_lock);
+  __atomic_fetch_add(&fastcgi_requests, 1, __ATOMIC_RELAXED);
+
+  // The CGI variables.  SCRIPT_NAME and SCRIPT_FILENAME leave off the query string.
+  snprintf(path, sizeof(path), "%s", url);
+  if ((query = strchr(path, '?')) != NULL)
+    *query++ = '\0';
+  snprintf(script_filename, sizeof(script_filename), "%s%s", WEBROOT, path);
+  snprintf(port, sizeof(port), "%d", PORT);
+
+  params_length = fastcgi_param(params, params_length, "GATEWAY_INTERFACE", "CGI/1.1");
+  params_length = fastcgi_param(params, params_length, "SERVER_SOFTWARE", "Minimal Web Server");
+  params_length = fastcgi_param(params, params_length, "SERVER_PROTOCOL", "HTTP/1.0");
+  params_length = fastcgi_param(params, params_length, "SERVER_PORT", port);
+  params_length = fastcgi_param(params, params_length, "REQUEST_METHOD", inflight.is_head ? "HEAD" : "GET");
+  params_length = fastcgi_param(params, params_length, "REQUEST_URI", url);
+  params_length = fastcgi_param(params, params_length, "DOCUMENT_ROOT", WEBROOT);
+  params_length = fastcgi_param(params, params_length, "SCRIPT_NAME", path);
+  params_length = fastcgi_param(params, params_length, "SCRIPT_FILENAME", script_filename);
+  params_length = fastcgi_param(params, params_length, "QUERY_STRING", query ? query : "");
+  params_length = fastcgi_param(params, params_length, "REMOTE_ADDR", client_ip);
+
+  /*
+    The whole request is four records, sent in one go:
+
+    1) FCGI_BEGIN_REQUEST, asking the application to act as a "responder" (take a request, send
+       back a response) and to keep the connection open afterwards.
+    2) FCGI_PARAMS with the CGI variables, then an empty FCGI_PARAMS to say there are no more.
+    3) An empty FCGI_STDIN: GET and HEAD requests have no body.
+  */
+  records_length = fastcgi_record(records, FCGI_BEGIN_REQUEST, request_id, 8);
+  memset(records + records_length, 0, 8);
+  records[records_length + 1] = FCGI_RESPONDER;
+  records[records_length + 2] = FCGI_KEEP_CONN;
+  records_length += 8;
+  records_length += fastcgi_record(records + records_length, FCGI_PARAMS, request_id, params_length);
+  records_length += params_length;
+  records_length += fastcgi_record(records + records_length, FCGI_PARAMS, request_id, 0);
+  records_length += fastcgi_record(records + records_length, FCGI_STDIN, request_id, 0);
+
+  pthread_mutex_lock(&connection->write_lock);
+  sent = send_all(connection->fd, (char *) records, records_length);
+  pthread_mutex_unlock(&connection->write_lock);
+
+  /*
+    Wait for our response, sending our client whatever output has been handed to us.  Whichever
+    waiting worker finds nobody reading the connection becomes its reader, and hands each record to
+    the request it belongs to until it has some output of its own to send, or its request is done.
+  */
+  pthread_mutex_lock(&fastcgi_lock);
+  if (!sent)
+    fastcgi_disconnect(connection);
+  while (!inflight.done || inflight.output_length > 0) {
+    if (inflight.output_length > 0) {
+      // Swap buffers, so the reader can carry on filling one while we send the other.
+      sending = inflight.output;
+      sending_length = inflight.output_length;
+      inflight.output = sending == buffers ? buffers + FASTCGI_OUTPUT_SIZE : buffers;
+      inflight.output_length = 0;
+      pthread_cond_broadcast(&fastcgi_changed);
+      pthread_mutex_unlock(&fastcgi_lock);
+      fastcgi_stdout(&inflight, sending, sending_length);
+      pthread_mutex_lock(&fastcgi_lock);
+    } else if (!connection->reading) {
+      connection->reading = 1;
+      pthread_mutex_unlock(&fastcgi_lock);
+      sent = fastcgi_read_record(connection);
+      pthread_mutex_lock(&fastcgi_lock);
+      connection->reading = 0;
+      if (!sent)
+        fastcgi_disconnect(connection);
+      pthread_cond_broadcast(&fastcgi_changed);
+    } else {
+      pthread_cond_wait(&fastcgi_changed, &fastcgi_lock);
+    }
+  }
+  connection->requests[request_id] = NULL;
+  connection->active--;
+  if (connection->broken)
+    fastcgi_disconnect(connection);
+  pthread_cond_broadcast(&fastcgi_changed);
+  pthread_mutex_unlock(&fastcgi_lock);
+
+  if (!inflight.head_sent) {
+    printf("502 Bad Gateway\n");
+    send_string(client_sock_fd, BAD_GATEWAY_RESPONSE);
+  }
+  free(buffers);
+}
+
+/*
+  Rate limiting.  Every client ip address, and every /24 network (the addresses that share their
+  first three numbers), gets a token bucket: it holds up to `burst` tokens, refills at `rate` tokens
+  a second, and each request takes one.  A request that finds the bucket empty gets a 429.  The /24
+  limit catches a scraper that spreads itself over a block of neighbouring addresses.
+
+  This runs on every request in every worker, so it has to be cheap: tens of nanoseconds, no locks.
+  Two tricks get it there:
+
+  1) A token bucket normally needs two numbers (tokens left, time of last refill), which can't be
+     updated together without a lock.  The "generic cell rate algorithm" (GCRA) stores the same
+     bucket as a single number instead: the theoretical arrival time ("tat"), the moment the bucket
+     would be full again if no more requests came.  Each request pushes it 1/rate seconds further
+     into the future, and a request is refused if that would put it more than burst/rate seconds
+     ahead of now.  One number can be updated with one atomic compare-and-swap.
+
+  2) The buckets live in a fixed-size open-addressing hash table, split into RATE_LIMIT_SHARDS
+     shards.  An address can only live in the RATE_LIMIT_PROBES slots of one 64-byte cache line,
+     so a lookup touches a single line of memory.  When those slots are all taken, the one with the
+     oldest tat, which is roughly the least recently used, is handed over to the new address.  Two
+     workers can race over a slot; the worst that happens is a bucket starting over full, which is
+     fine for rate limiting.
+*/
+#define RATE_LIMIT_RATE 100 // requests per second allowed from one address
+#define RATE_LIMIT_BURST 200 // requests one address may make in a burst
+#define RATE_LIMIT_PREFIX_RATE 1000 // requests per second allowed from one /24
+#define RATE_LIMIT_PREFIX_BURST 2000 // requests one /24 may make in a burst
+#define RATE_LIMIT_SHARDS 64
+#define RATE_LIMIT_SHARD_SLOTS 1024 // a power of two
+#define RATE_LIMIT_PROBES 4 // slots in a 64-byte cache line
+
+struct rate_limit_slot {
+  uint64_t key; // 0 for an empty slot
+  uint64_t tat; // nanoseconds
+};
+
+struct rate_limit_shard {
+  struct rate_limit_slot slots[RATE_LIMIT_SHARD_SLOTS];
+} __attribute__((aligned(64)));
+
+struct rate_limit_shard rate_limit_table[RATE_LIMIT_SHARDS];
+
+unsigned long rate_limited; // requests refused with a 429
+unsigned long rate_limit_evictions;
+
+/*
+  `struct rate_limit_slot *rate_limit_take(uint64_t key, uint64_t now, uint64_t interval, uint64_t tolerance)`
+  takes a token from the bucket of `key`.  `interval` is the time it takes the bucket to earn one
+  token and `tolerance` how far ahead of `now` its tat may run, both in nanoseconds.  Returns the
+  bucket's slot if the request may go ahead, so the token can be handed back, and NULL if the
+  bucket is empty.
+*/
+struct rate_limit_slot *rate_limit_take(uint64_t key, uint64_t now, uint64_t interval, uint64_t tolerance) {
+  uint64_t hash = key * 0x9E3779B97F4A7C15UL; // Fibonacci hashing: one multiply
+  struct rate_limit_shard *shard = &rate_limit_table[hash >> 58]; // top 6 bits pick 1 of 64 shards
+  struct rate_limit_slot *group = &shard->slots[(hash >> 20) & (RATE_LIMIT_SHARD_SLOTS - RATE_LIMIT_PROBES)];
+  struct rate_limit_slot *slot = NULL;
+  struct rate_limit_slot *victim = group;
+  uint64_t slot_key;
+  uint64_t tat;
+  uint64_t oldest = UINT64_MAX;
+  uint64_t base;
+  int i;
+
+  for (i = 0; i < RATE_LIMIT_PROBES && slot == NULL; i++) {
+    slot_key = __atomic_load_n(&group[i].key, __ATOMIC_RELAXED);
+    if (slot_key == 0 && __atomic_compare_exchange_n(&group[i].key, &slot_key, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      slot_key = key; // we claimed an empty slot
+    if (slot_key == key) {
+      slot = &group[i];
+    } else if ((tat = __atomic_load_n(&group[i].tat, __ATOMIC_RELAXED)) < oldest) {
+      oldest = tat;
+      victim = &group[i];
+    }
+  }
+
+  if (slot == NULL) {
+    // Evict the least recently used address; its bucket starts over full for the new one.
+    __atomic_store_n(&victim->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->tat, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rate_limit_evictions, 1, __ATOMIC_RELAXED);
+    slot = victim;
+  }
+
+  tat = __atomic_load_n(&slot->tat, __ATOMIC_RELAXED);
+  do {
+    base = tat > now ? tat : now;
+    if (base - now > tolerance)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(&slot->tat, &tat, base + interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return slot;
+}
+
+/*
+  `int rate_limit_allow(struct sockaddr_in *client_addr_ptr)` returns 1 if the client's address and
+  its /24 both have a token to spare, and 0 if the request should be refused.  A request the /24
+  refuses gives the address its token back: it's not the address's fault its neighbours are busy.
+*/
+int rate_limit_allow(struct sockaddr_in *client_addr_ptr) {
+  uint32_t address = ntohl(client_addr_ptr->sin_addr.s_addr);
+  struct rate_limit_slot *slot;
+  struct timespec clock;
+  uint64_t now;
+
+  // The coarse clock is only as precise as the kernel's tick, but it's read without a system call.
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &clock);
+  now = clock.tv_sec * 1000000000UL + clock.tv_nsec;
+
+  // Tag the keys so an address and a /24 can never collide, and so no key is ever 0.
+  slot = rate_limit_take(1UL << 32 | address, now,
+                         1000000000UL / RATE_LIMIT_RATE, (RATE_LIMIT_BURST - 1) * (1000000000UL / RATE_LIMIT_RATE));
+  if (slot == NULL)
+    return 0;
+  if (rate_limit_take(2UL << 32 | (address & 0xffffff00), now,
+                      1000000000UL / RATE_LIMIT_PREFIX_RATE, (RATE_LIMIT_PREFIX_BURST - 1) * (1000000000UL / RATE_LIMIT_PREFIX_RATE)) == NULL) {
+    /*
+      If the slot has been handed to another address since, the token goes to that one instead:
+      like a race over a slot, that's harmless.
+    */
+    __atomic_fetch_sub(&slot->tat, 1000000000UL / RATE_LIMIT_RATE, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+  `void send_stats(int client_sock_fd)` answers requests for STATS_URL with the server's counters,
+  in the plain text format Prometheus scrapes.
 */
-int read_line(int sock_fd, char *dest_buffer) { 
-  #define EOL "\r\n" // End-of-line byte sequence
-  #define EOL_SIZE 2
+void send_stats(int client_sock_fd) {
+  char stats[16384];
+  int length = 0;
+  int route_index;
+  int bucket;
+  int node;
+  int i;
+  uint64_t count;
+  unsigned long cumulative;
+  struct upstream_state *state;
 
-  int eol_indx = 0; // index for EOL matching
+  #define STAT(...) length += snprintf(stats + length, sizeof(stats) - length, __VA_ARGS__)
 
-  char *ptr; 
-  ptr = dest_buffer;
+  for (route_index = 0; route_index < PROXY_ROUTE_COUNT && length < (int) sizeof(stats) - 1024; route_index++) {
+    state = &upstream_states[route_index];
+    STAT("proxy_pool_hits{route=\"%s\"} %lu\n", proxy_routes[route_index].prefix, state->pool_hits);
+    STAT("proxy_pool_misses{route=\"%s\"} %lu\n", proxy_routes[route_index].prefix, state->pool_misses);
+    STAT("proxy_upstream_up{route=\"%s\"} %d\n", proxy_routes[route_index].prefix, time(NULL) >= state->down_until);
 
-  /*
-     `recv(int socket, void *buffer, size_t length, int flags)` receives a message from the socket `socket`
-     and stores the message at the location pointed to by the pointer `buffer`. The `length` specifies the
-     number of chars written to the buffer. 
-     
-     In the invocation below, we are reading only one byte from the socket `sock_fd` and storing it in the buffer that
-     is pointed by `ptr`.
- */
-  while(recv(sock_fd, ptr, 1, 0) == 1) {
-    // *ptr matches \r, the first char of the EOL sequence
-    if (*ptr == EOL[eol_indx]) { 
-      eol_indx++; // increment so we can next compare to \n
-      if (eol_indx == EOL_SIZE) { 
-        // We found \r\n, the EOL byte sequence.
-        *(ptr+1-EOL_SIZE) = '\0'; // terminate the string.
+    cumulative = 0;
+    for (bucket = 0; bucket <= LATENCY_BUCKETS; bucket++) {
+      cumulative += state->latency_buckets[bucket];
+      if (bucket < LATENCY_BUCKETS)
+        STAT("proxy_upstream_latency_us_bucket{route=\"%s\",le=\"%ld\"} %lu\n",
+             proxy_routes[route_index].prefix, latency_bucket_bounds[bucket], cumulative);
+      else
+        STAT("proxy_upstream_latency_us_bucket{route=\"%s\",le=\"+Inf\"} %lu\n", proxy_routes[route_index].prefix, cumulative);
+    }
+    STAT("proxy_upstream_latency_us_sum{route=\"%s\"} %lu\n", proxy_routes[route_index].prefix, state->latency_sum);
+    STAT("proxy_upstream_latency_us_count{route=\"%s\"} %lu\n", proxy_routes[route_index].prefix, cumulative);
+  }
 
-        // We've received all the data up to the EOL, so stop writing and return the number of chars written to the buffer.
-        return strlen(dest_buffer);
-      }
-    } else { 
-      eol_indx = 0;
+  STAT("proxy_cache_hits %lu\n", proxy_cache_hits);
+  STAT("proxy_cache_stale_hits %lu\n", proxy_cache_stale_hits);
+  STAT("proxy_cache_misses %lu\n", proxy_cache_misses);
+  STAT("proxy_cache_coalesced %lu\n", proxy_cache_coalesced);
+  STAT("proxy_cache_passes %lu\n", proxy_cache_passes);
+  STAT("proxy_cache_revalidations %lu\n", proxy_cache_revalidations);
+  for (node = 0; node < MAX_NUMA_NODES; node++) {
+    if (proxy_cache_shards[node] != NULL)
+      STAT("proxy_cache_bytes{node=\"%d\"} %ld\n", node, proxy_cache_shards[node]->bytes);
+  }
+  STAT("fastcgi_requests %lu\n", fastcgi_requests);
+  STAT("fastcgi_waits %lu\n", fastcgi_waits);
+  STAT("fastcgi_rejected %lu\n", fastcgi_rejected);
+  STAT("fastcgi_dropped %lu\n", fastcgi_dropped);
+  STAT("rate_limited %lu\n", rate_limited);
+  STAT("rate_limit_evictions %lu\n", rate_limit_evictions);
+  STAT("busy_poll_spin_hits %lu\n", busy_poll_spin_hits);
+  STAT("busy_poll_sleeps %lu\n", busy_poll_sleeps);
+  STAT("file_cache_hits %lu\n", file_cache_hits);
+  STAT("file_cache_misses %lu\n", file_cache_misses);
+  STAT("file_cache_bytes %ld\n", file_cache_bytes);
+  STAT("file_cache_rejections %lu\n", file_cache_rejections);
+  STAT("file_cache_coalesced %lu\n", file_cache_coalesced);
+  STAT("file_cache_shared %lu\n", content_shared);
+  STAT("file_cache_shared_bytes %lu\n", content_shared_bytes);
+  STAT("range_requests %lu\n", range_requests);
+  STAT("block_cache_sent %lu\n", block_cache_sent);
+  STAT("block_cache_reads %lu\n", block_cache_reads);
+  STAT("block_cache_bytes %ld\n", __atomic_load_n(&block_cache_bytes, __ATOMIC_RELAXED));
+  STAT("zerocopy_sends %lu\n", zerocopy_sends);
+  STAT("zerocopy_copied %lu\n", zerocopy_copied);
+  STAT("zerocopy_parked %lu\n", zerocopy_parked);
+  STAT("zerocopy_resets %lu\n", zerocopy_resets);
+  STAT("zerocopy_abandoned %lu\n", zerocopy_abandoned);
+  STAT("compressed_cache_gzip_hits %lu\n", compressed_cache_gzip_hits);
+  STAT("compressed_cache_inflated %lu\n", compressed_cache_inflated);
+  STAT("compressed_cache_incompressible %lu\n", compressed_cache_incompressible);
+  STAT("compressed_cache_bytes %ld\n", __atomic_load_n(&compressed_cache_bytes, __ATOMIC_RELAXED));
+  STAT("compressed_cache_original_bytes %ld\n", __atomic_load_n(&compressed_cache_original_bytes, __ATOMIC_RELAXED));
+  for (node = 0; node < MAX_NUMA_NODES; node++) {
+    if (cache_arenas[node].base != NULL) {
+      STAT("cache_arena_bytes{node=\"%d\",pages=\"%s\"} %ld\n", node, cache_arenas[node].pages, cache_arenas[node].used);
+      STAT("cache_arena_free_bytes{node=\"%d\"} %ld\n", node, cache_arenas[node].free_bytes);
     }
-    ptr++;
   }
-  // Didn't find the end-of-line characters. Note buffer dest_buffer still has the message from the `sock_fd`.
-  return 0; 
+  STAT("epoch_freed %lu\n", epoch_freed);
+  STAT("cache_arena_fallbacks %lu\n", cache_arena_fallbacks);
+  STAT("disk_io_inline %lu\n", disk_io_inline);
+  STAT("disk_io_offloaded %lu\n", disk_io_offloaded);
+  STAT("stream_dropped_bytes %lu\n", stream_dropped_bytes);
+  STAT("warmup_files %lu\n", warmup_files);
+  STAT("cache_snapshot_files %lu\n", cache_snapshot_files);
+  STAT("warmup_milliseconds %ld\n", warmup_milliseconds);
+  STAT("target_hit_rate_milliseconds %ld\n", target_hit_rate_milliseconds);
+  for (i = 0; i < WORKERS; i++) {
+    if (worker_contexts[i].tlb_miss_fd != -1 && read(worker_contexts[i].tlb_miss_fd, &count, sizeof(count)) == sizeof(count))
+      STAT("dtlb_load_misses{worker=\"%d\"} %llu\n", i, (unsigned long long) count);
+  }
+  STAT("incoming_cpu_local %lu\n", incoming_cpu_local);
+  STAT("incoming_cpu_other %lu\n", incoming_cpu_other);
+
+  #undef STAT
+
+  send_string(client_sock_fd, STATS_HEADER);
+  send_all(client_sock_fd, stats, length);
 }
 
 /*
-  `void process_request(int sockfd, struct sockaddr_in *client_addr_ptr)` processes the incoming http request.
+  `int process_request(int sockfd, struct sockaddr_in *client_addr_ptr)` processes the incoming http request.
 
    `sockfd` is the socket file descriptor for the client with address pointed to by `client_addr_ptr`.
+   Returns 1 when it's done with the client, or 0 if the request was handed to the disk I/O pool,
+   which then finishes it (and closes `sockfd`) in its own time.
 */
-void process_request(int client_sock_fd, struct sockaddr_in *client_addr_ptr) {
-  char *http_check;
+int process_request(int client_sock_fd, struct sockaddr_in *client_addr_ptr) {
   char *url;
-  char *file;
+  struct cached_response *response;
   char request[500]; 
   char resource[500];
+  char client_ip[INET_ADDRSTRLEN];
   int resource_fd;
-  int length;
-  int file_size;
+  int route_index;
+  int is_head;
+  int would_block;
+  struct request_headers headers;
 
   // copy line from `client_sock_fd` socket and save in `request' string
-  length = read_line(client_sock_fd, request);
+  read_line(client_sock_fd, request);
+  skip_headers(client_sock_fd, &headers);
+
+  // Turn away clients that are over their rate limit before doing any other work for them.
+  if (!rate_limit_allow(client_addr_ptr)) {
+    __atomic_fetch_add(&rate_limited, 1, __ATOMIC_RELAXED);
+    send_all(client_sock_fd, TOO_MANY_REQUESTS_RESPONSE, sizeof(TOO_MANY_REQUESTS_RESPONSE) - 1);
+    shutdown(client_sock_fd, SHUT_RDWR);
+    return 1;
+  }
+
+  /*
+    `inet_ntop` turns the client's binary address into the familiar dotted string.  We can't use the
+    older `inet_ntoa` here because it returns the same static buffer to every caller, and with
+    several workers running at once they would scribble over each other's addresses.
+  */
+  inet_ntop(AF_INET, &client_addr_ptr->sin_addr, client_ip, sizeof(client_ip));
 
   // log client address, port and request
   printf(
     "Client Address: %s\nClient Port: %d\nRequest: %s\n",
-    inet_ntoa(client_addr_ptr->sin_addr),
+    client_ip,
     ntohs(client_addr_ptr->sin_port),
     request
   );
 
-  /*
-    If the request is a valid http request, it would be a string that looks something like:
+  // Parse the url out of the request line.  It's NULL if this isn't a GET or HEAD request.
+  url = parse_request_line(request);
+  is_head = strncmp(request, "HEAD ", 5) == 0;
 
-      GET /path/my/awesome/webpage.html HTTP/1.0
+  if (url != NULL && strcmp(url, STATS_URL) == 0) {
+    send_stats(client_sock_fd);
+  } else if (url != NULL && (route_index = find_proxy_route(url)) != -1) {
+    printf("Proxying to %s:%d\n", proxy_routes[route_index].host, proxy_routes[route_index].port);
+    proxy_request(client_sock_fd, request, url, client_ip, route_index);
+  } else if (url != NULL && (route_index = find_fastcgi_route(url)) != -1) {
+    printf("FastCGI application at %s\n", fastcgi_routes[route_index].socket_path);
+    fastcgi_request(client_sock_fd, request, url, client_ip, route_index);
+  } else if (url != NULL) {
+    resource_path(url, resource);
 
-      We verify its a valid HTTP request by checking for the substring "HTTP"
-      Note that http_check is a pointer to the first char of the substring.
-  */
-  http_check = strstr(request, " HTTP/");
+    printf("Resource Requested: %s \n", resource);
 
-  if (http_check == NULL){
-    // Not valid HTTP request
-    printf(" Not valid HTTP Request.\n");
-  } else {
-    /* 
-       We first remove the HTTP part from string `request` (since we already know its an HTTP request)
-       by setting the `http_check` pointer (which is currently pointing to the space before H) to 0.
+    // Connect to the file in read-only mode
+    resource_fd = open(resource, O_RDONLY, 0);
+
+    /*
+      Answer right here if that can't block on the disk: a 404, a HEAD, or a file that's in the
+      file cache or the page cache.  For a file too big for the file cache, it's enough that the
+      beginning is in the page cache; the kernel reads ahead of us from there.  Any other file
+      goes to the disk I/O pool.
     */
-    *http_check = 0; 
-
-    /* 
-       Let's parse the url, but first set it to the NULL pointer so we know if we successfully
-       parsed it.
-    */ 
-    url = NULL;
-
-    if (strncmp(request, "GET ", 4) == 0)
-      // If it's a GET request, then set pointer `url` to point at start of the request url
-      url = request+4;
-
-    if (strncmp(request, "HEAD ", 5) == 0)
-      // If it's a HEAD request, then set pointer `url` to point at start of the request url
-      url = request+5;
-
-     if (url == NULL) {
-       // Unknown Request
-       printf("Unknown Request\n");
-     } else {
-
-       // If the url string ends in '/', just add on index.html at the end.
-       if (url[strlen(url) -1] == '/')
-         strcat(url, "index.html");
-
-       strcpy(resource, WEBROOT);
-       strcat(resource, url);
-        
-       // Connect to the file in read-only mode
-       resource_fd = open(resource, O_RDONLY, 0);
-
-       printf("Resource Requested: %s \n", resource);
-
-       if (resource_fd == -1) { 
-         // If file is not found
-         printf("404 Not Found\n");
-         send_string(client_sock_fd, "HTTP/1.0 404 NOT FOUND\r\n");
-         send_string(client_sock_fd, "Server: Minimal Web Server\r\n\r\n"); 
-         send_string(client_sock_fd, "<html><head><title>404 Not Found</title></head>"); 
-         send_string(client_sock_fd, "<body><h1>URL not found</h1></body></html>\r\n");
-       } else {
-         // File is found
-         
-         // If it's a GET request
-         if (strncmp(request, "GET ", 4) == 0) {
-           // serve up the header and the requested file
-           send_string(client_sock_fd, "HTTP/1.0 200 OK\r\n");
-           send_string(client_sock_fd, "Server: Minimal Web Server\r\n\r\n");
-
-           // Determine the file size in bytes
-           file_size = get_file_size(resource_fd);
-
-           // Allocate memory to store the file in the local variable `file`.
-           file = (char *) malloc(length);
-
-           // Read target file into memory and save in local `file`. 
-           read(resource_fd, file, file_size);
-
-           // Send file to client 
-           send(client_sock_fd, file, file_size, 0);
-
-           // free memory for file
-           free(file);
-         }
-
-         // If it's a HEAD request
-         if (strncmp(request, "HEAD ", 5) == 0) {
-           // just serve up the header
-           send_string(client_sock_fd, "HTTP/1.0 200 OK\r\n");
-           send_string(client_sock_fd, "Server: Minimal Web Server\r\n\r\n");
-         }
-
-         // close the file
-         close(resource_fd);
-       }
-     }
+    response = NULL;
+    would_block = 0;
+    if (resource_fd != -1 && !is_head) {
+      // A range is cut from the file as it is, not from a gzipped copy.
+      response = file_cache_lookup(resource, resource_fd, headers.accepts_gzip && !headers.has_range, &would_block);
+      if (response == NULL && !would_block && !large_file_ready(resource_fd, &headers, 0))
+        would_block = 1;
+    }
+    if (would_block && disk_io_submit(current_worker, client_sock_fd, is_head, resource, resource_fd, &headers))
+      return 0;
+
+    __atomic_fetch_add(&disk_io_inline, 1, __ATOMIC_RELAXED);
+    send_file_response(client_sock_fd, is_head, resource_fd, response, &headers);
   }
 
   /*
@@ -234,18 +5283,487 @@ void process_request(int client_sock_fd, struct sockaddr_in *client_addr_ptr) {
      3) `SHUT_RDWR` to shutdown send and receive operations.
   */
   shutdown(client_sock_fd, SHUT_RDWR);
+  return 1;
 }
 
-int main(void) {
-  int host_sock_fd;
-  int client_sock_fd;
-  int option_value = 1;
+/*
+  `int send_datagrams(int udp_fd, struct sockaddr_in *addr, char *buffer, int length)` sends
+  `buffer` to `addr` cut into UDP_SEGMENT_SIZE datagrams.  Returns 1 on success and 0 on failure.
+
+  Rather than one `sendto` per datagram, we hand the kernel up to UDP_GSO_SEGMENTS datagrams' worth
+  of bytes at once along with a UDP_SEGMENT control message saying how big each datagram should be.
+  The kernel (or the NIC) then does the cutting, so we pay for one system call instead of 32.  This
+  is "generic segmentation offload", or GSO.
 
+  Kernels older than 4.18 don't know UDP_SEGMENT; on those we fall back to one datagram per call.
+*/
+int send_datagrams(int udp_fd, struct sockaddr_in *addr, char *buffer, int length) {
+  static int gso_supported = 1; // only the UDP listener thread sends datagrams
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  uint16_t segment_size = UDP_SEGMENT_SIZE;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int chunk;
+
+  while (length > 0) {
+    chunk = gso_supported ? UDP_SEGMENT_SIZE * UDP_GSO_SEGMENTS : UDP_SEGMENT_SIZE;
+    if (chunk > length)
+      chunk = length;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buffer;
+    iov.iov_len = chunk;
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (chunk > UDP_SEGMENT_SIZE) {
+      // Attach the segment size as a SOL_UDP/UDP_SEGMENT control message.
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+    }
+
+    if (sendmsg(udp_fd, &msg, 0) == -1) {
+      if (msg.msg_control != NULL && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)) {
+        // No GSO here.  Resend this chunk one datagram at a time.
+        gso_supported = 0;
+        continue;
+      }
+      return 0;
+    }
+    buffer += chunk;
+    length -= chunk;
+  }
+  return 1;
+}
+
+/*
+  `void process_datagram(int udp_fd, struct sockaddr_in *client_addr_ptr, char *datagram, int length)`
+  is the UDP twin of `process_request`: `datagram` holds one request line, and the response goes
+  back to `client_addr_ptr` as datagrams.  Requests are resolved with the same `parse_request_line`
+  and `open_resource` helpers, so both listeners always serve the same file for a url, and files
+  small enough come out of the same file cache.
+*/
+void process_datagram(int udp_fd, struct sockaddr_in *client_addr_ptr, char *datagram, int length) {
+  static char body[UDP_SEGMENT_SIZE * UDP_GSO_SEGMENTS];
+  struct cached_response *response;
+  char request[500];
+  char resource[500];
+  char *url;
+  int resource_fd;
+  int read_bytes;
+
+  // Copy the request line out of the datagram, leaving room for `open_resource` to add "index.html".
+  if (length > (int) sizeof(request) - 20)
+    length = sizeof(request) - 20;
+  memcpy(request, datagram, length);
+  request[length] = '\0';
+
+  // A request line sent from a terminal may end in "\r\n"; chop that off.
+  request[strcspn(request, "\r\n")] = '\0';
+
+  printf(
+    "UDP Client Address: %s\nUDP Client Port: %d\nRequest: %s\n",
+    inet_ntoa(client_addr_ptr->sin_addr),
+    ntohs(client_addr_ptr->sin_port),
+    request
+  );
+
+  // Accept the request line with or without the " HTTP/1.0" suffix.
+  if (strstr(request, " HTTP/") == NULL)
+    strcat(request, " HTTP/1.0");
+
+  url = parse_request_line(request);
+  if (url == NULL)
+    return;
+
+  resource_fd = open_resource(url, resource);
+  printf("Resource Requested: %s \n", resource);
+
+  if (resource_fd == -1) {
+    printf("404 Not Found\n");
+    send_datagrams(udp_fd, client_addr_ptr, NOT_FOUND_RESPONSE, strlen(NOT_FOUND_RESPONSE));
+    return;
+  }
+
+  if (strncmp(request, "GET ", 4) == 0 && (response = file_cache_lookup(resource, resource_fd, 0, NULL)) != NULL) {
+    // the head and the file, straight from the file cache
+    send_datagrams(udp_fd, client_addr_ptr, response->data, response->length);
+    cached_response_release(response);
+    close(resource_fd);
+    return;
+  }
+
+  send_datagrams(udp_fd, client_addr_ptr, OK_HEADER, strlen(OK_HEADER));
+
+  // For a GET of a file too big for the file cache, stream it out one GSO burst at a time.
+  if (strncmp(request, "GET ", 4) == 0) {
+    while ((read_bytes = read(resource_fd, body, sizeof(body))) > 0) {
+      if (!send_datagrams(udp_fd, client_addr_ptr, body, read_bytes))
+        break;
+    }
+  }
+
+  close(resource_fd);
+}
+
+/*
+  `void *udp_listener(void *unused)` runs the experimental UDP listener forever.  It's started on
+  its own thread by `main`, so it runs alongside the TCP accept loop.
+*/
+void *udp_listener(void *unused) {
+  static char buffers[UDP_BATCH][UDP_GRO_BUFFER_SIZE];
+  char controls[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  struct sockaddr_in addrs[UDP_BATCH];
   struct sockaddr_in host_addr;
-  struct sockaddr_in client_addr;
+  struct cmsghdr *cmsg;
+  int udp_fd;
+  int option_value = 1;
+  int count;
+  int segment_size;
+  int offset;
+  int i;
+
+  (void) unused;
+
+  // `SOCK_DGRAM` asks for a UDP socket, where `SOCK_STREAM` would have given us TCP.
+  if ((udp_fd = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
+    printf("%s", "Failed to create UDP socket\n");
+    return NULL;
+  }
+
+  setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(int));
+
+  host_addr.sin_family = AF_INET;
+  host_addr.sin_port = htons(UDP_PORT);
+  host_addr.sin_addr.s_addr = 0;
+  memset(&(host_addr.sin_zero), '\0', 8);
+
+  if (bind(udp_fd, (struct sockaddr *)&host_addr, sizeof(struct sockaddr)) == -1) {
+    printf("%s", "Failed to Bind UDP Socket to Host Address\n");
+    close(udp_fd);
+    return NULL;
+  }
+
+  /*
+    UDP_GRO ("generic receive offload") lets the kernel glue a run of same-sized datagrams from one
+    sender into a single big read, telling us the original datagram size in a control message.  It
+    is the mirror image of UDP_SEGMENT.  It's fine if the kernel is too old for it; we then just
+    get one datagram per read.
+  */
+  if (setsockopt(udp_fd, SOL_UDP, UDP_GRO, &option_value, sizeof(int)) == -1)
+    printf("%s", "UDP_GRO not supported, receiving datagrams one by one\n");
+
+  printf("Starting experimental UDP listener on Port %d\n", UDP_PORT);
+
+  // Point each of the UDP_BATCH message headers at its own buffer, address and control area.
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < UDP_BATCH; i++) {
+    iovs[i].iov_base = buffers[i];
+    iovs[i].iov_len = UDP_GRO_BUFFER_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_control = controls[i];
+  }
+
+  while (1) {
+    // The kernel overwrites these lengths on every call, so reset them.
+    for (i = 0; i < UDP_BATCH; i++) {
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+
+    /*
+      `recvmmsg` is `recvfrom` for many datagrams at once.  MSG_WAITFORONE makes it block until at
+      least one datagram is there, then return with however many (up to UDP_BATCH) are queued.
+    */
+    count = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      printf("%s", "UDP listener failed to receive\n");
+      break;
+    }
+
+    for (i = 0; i < count; i++) {
+      // Unless GRO says otherwise, the read is a single datagram.
+      segment_size = msgs[i].msg_len;
+      for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+          memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+      }
+      if (segment_size <= 0)
+        continue;
+
+      // Split a coalesced read back into the datagrams the client sent.
+      for (offset = 0; offset < (int) msgs[i].msg_len; offset += segment_size) {
+        process_datagram(
+          udp_fd,
+          &addrs[i],
+          buffers[i] + offset,
+          (int) msgs[i].msg_len - offset < segment_size ? (int) msgs[i].msg_len - offset : segment_size
+        );
+      }
+    }
+  }
+
+  close(udp_fd);
+  return NULL;
+}
+
+/*
+  `long spin_budget(long average_gap)` decides how many microseconds a worker should spin before
+  it sleeps, given the average gap between its recent wake-ups.  If connections have been arriving
+  more often than every BUSY_POLL_MICROSECONDS, the next one will probably turn up within twice
+  the average gap, so spin that long.  If they've been arriving less often than that, spinning would
+  most likely be wasted, so don't.
+*/
+long spin_budget(long average_gap) {
+  if (average_gap >= BUSY_POLL_MICROSECONDS)
+    return 0;
+  return 2 * average_gap < BUSY_POLL_MICROSECONDS ? 2 * average_gap : BUSY_POLL_MICROSECONDS;
+}
+
+/*
+  `void steer_connections(void)` attaches a classic BPF program to the workers' listening sockets
+  that hands each new connection to the worker pinned to the CPU that received it.
+
+  The kernel runs the program whenever a connection arrives for the port, on the CPU handling the
+  connection's packets, and takes the number it returns as the index of the listening socket to
+  use, in the order the sockets started listening, which is worker order.  The program loads the
+  current CPU's number and compares it with each worker's CPU in turn:
+
+      ld  #cpu
+      jeq #<worker 0's cpu>, 0, 1   (if equal, fall through to the next line; if not, skip it)
+      ret #0
+      jeq #<worker 1's cpu>, 0, 1
+      ret #1
+      ...
+      ret #WORKERS
+
+  A CPU without a worker gets WORKERS, which is no socket at all, and the kernel falls back to
+  hashing the connection onto one.  So that's what happens when there are fewer workers than CPUs.
+  With more workers than CPUs, some workers share a CPU and the program could only ever pick one of
+  them, so it isn't attached; connections are then spread by SO_INCOMING_CPU and hashing alone.
+*/
+void steer_connections(void) {
+  struct sock_filter code[2 * WORKERS + 2];
+  struct sock_fprog program;
+  int length = 0;
+  int i;
+  int j;
+
+  for (i = 0; i < WORKERS; i++) {
+    if (worker_contexts[i].cpu < 0) {
+      printf("%s", "Workers aren't pinned, not steering connections to them\n");
+      return;
+    }
+    for (j = 0; j < i; j++) {
+      if (worker_contexts[j].cpu == worker_contexts[i].cpu) {
+        printf("%s", "Workers share CPUs, not steering connections to them\n");
+        return;
+      }
+    }
+  }
+
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for (i = 0; i < WORKERS; i++) {
+    code[length++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, worker_contexts[i].cpu, 0, 1);
+    code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, WORKERS);
+
+  program.len = length;
+  program.filter = code;
+
+  // The program belongs to the whole group of sockets sharing the port, so attach it to any one.
+  if (setsockopt(worker_contexts[0].listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1)
+    printf("%s", "SO_ATTACH_REUSEPORT_CBPF not supported\n");
+}
+
+/*
+  `void *worker(void *context_ptr)` is a worker thread's accept loop: it takes connections off its
+  own listening socket (see `struct worker_context`, which `context_ptr` points to) and processes
+  them, forever.
+
+  The worker waits for connections with epoll (Linux's way of waiting on many file descriptors at
+  once).  When it wakes up it takes every connection waiting in the queue, up to ACCEPT_BATCH of
+  them, before it goes back to sleep.  Under load that's one wake-up for a whole batch of
+  connections.  Since every worker has a queue of its own, a connection waits for its own worker
+  even when another is idle; in exchange, workers never contend for a queue.
+
+  In busy-poll mode the worker spins, asking epoll over and over without sleeping, for up to
+  `spin_budget` microseconds before it sleeps.  The budget is worked out from an exponentially
+  weighted moving average of the gaps between wake-ups: each new gap moves the average 1/8 of the
+  way towards itself, so the average follows the recent arrival rate without jumping around.
+*/
+#define WORKER_EVENTS 64 // the listener, the disk I/O pool's eventfd, and the sockets of parked chains
+
+void *worker(void *context_ptr) {
+  struct worker_context *context = context_ptr;
+  int host_sock_fd = context->listen_fd;
+  int client_sock_fds[ACCEPT_BATCH];
+  struct sockaddr_in client_addrs[ACCEPT_BATCH];
+  struct epoll_event event;
+  struct epoll_event events[WORKER_EVENTS];
   socklen_t sin_size;
+  int epoll_fd;
+  int completion_fd;
+  int accepted;
+  int ready;
+  int listener_ready;
+  int incoming_cpu;
+  int i;
+  long spin_until;
+  long woke;
+  long last_woke = now_microseconds();
+  long average_gap = 1000000; // start out assuming we're idle
 
-  printf("Starting Minimal Web Server on Port %d\n", PORT);
+  current_worker = context;
+  proxy_cache = proxy_cache_shards[context->node];
+  open_tlb_counter(context);
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    printf("%s", "Could not create epoll instance\n");
+    return NULL;
+  }
+  context->epoll_fd = epoll_fd;
+  event.events = EPOLLIN;
+  event.data.fd = host_sock_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, host_sock_fd, &event) == -1) {
+    printf("%s", "Could not watch the listening socket\n");
+    return NULL;
+  }
+
+  // Watch for jobs coming back from the disk I/O pool, too.  Without this the worker does its own I/O.
+  if ((completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1) {
+    event.events = EPOLLIN;
+    event.data.fd = completion_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, completion_fd, &event) == 0)
+      context->completion_fd = completion_fd;
+    else
+      close(completion_fd);
+  }
+
+  while(1) { // basically run this worker forever until control-C'ed
+
+    // In busy-poll mode, spin for a while first.  A timeout of 0 makes `epoll_wait` return at once.
+    ready = 0;
+    if (BUSY_POLL_MICROSECONDS > 0) {
+      spin_until = now_microseconds() + spin_budget(average_gap);
+      while (ready <= 0 && now_microseconds() < spin_until)
+        ready = epoll_wait(epoll_fd, events, WORKER_EVENTS, 0);
+      if (ready > 0)
+        __atomic_fetch_add(&busy_poll_spin_hits, 1, __ATOMIC_RELAXED);
+      else
+        __atomic_fetch_add(&busy_poll_sleeps, 1, __ATOMIC_RELAXED);
+    }
+
+    /*
+      Sleep until there's at least one connection waiting to be accepted, a finished disk job, or
+      news of a parked chain; with chains parked, for a second at most, to check their deadlines.
+    */
+    if (ready <= 0 && (ready = epoll_wait(epoll_fd, events, WORKER_EVENTS,
+                                          context->zerocopy_pending != NULL ? 1000 : -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+      printf("%s", "Failed waiting for connections\n");
+      return NULL;
+    }
+
+    listener_ready = 0;
+    for (i = 0; i < ready; i++) {
+      if (events[i].data.fd == context->completion_fd)
+        finish_disk_jobs(context);
+      else if (events[i].data.fd == host_sock_fd)
+        listener_ready = 1;
+      else
+        zerocopy_collect(context, events[i].data.fd);
+    }
+    if (context->zerocopy_pending != NULL)
+      zerocopy_collect(context, -1);
+    if (!listener_ready)
+      continue;
+
+    woke = now_microseconds();
+    average_gap += (woke - last_woke - average_gap) / 8;
+    last_woke = woke;
+
+    for (accepted = 0; accepted < ACCEPT_BATCH; ) {
+      sin_size = sizeof(struct sockaddr_in); // get the size of struct type sockaddr_in
+
+      /*
+        `int accept(int socket, struct sockaddr address, socklen_t address_len)` accepts a new connection on `socket`.
+        Technically, it accepts the first connection on the queue of pending connections, creates a new socket
+        with the same configuration as `socket` and allocates a new file descriptor for that new socket
+        and then returns that file descriptor, which is connected to a client. 
+
+        Referring to the invocation below, the new socket is connected to a remote client and cannot accept more
+        connections.  However `host_sock_fd` remains open and can accept new connections.
+
+        `accept` also stores the connections address info in `struct sockaddr address`. Referring to the
+        invocation below, the client's address information gets stored in `client_addrs` struct,
+        but note we typecast it to the sockaddr type. Again, note the typcasting from sockaddr_in to sockaddr
+        trick in use again here.
+
+        We use `accept4`, which is `accept` with a fourth argument of flags for the new socket, saving
+        us a `fcntl` call per connection.  SOCK_NONBLOCK makes the new socket non-blocking (see
+        `wait_for_socket`), and SOCK_CLOEXEC keeps it from leaking into any program we might start.
+        The listening socket is non-blocking too, so once the queue is empty `accept4` fails with
+        EAGAIN instead of hanging, and we know we've drained it.
+      */
+      client_sock_fds[accepted] = accept4(host_sock_fd, (struct sockaddr *)&client_addrs[accepted], &sin_size,
+                                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+      if (client_sock_fds[accepted] == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break; // the queue is empty
+        // A client that gave up while waiting in the queue, or a signal, is no reason to stop.
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        printf("%s", "Socket failed to accept.\n");
+        return NULL;
+      }
+      accepted++;
+    }
+
+    for (i = 0; i < accepted; i++) {
+      // Count whether the connection's packets were received on this worker's own CPU.
+      sin_size = sizeof(int);
+      if (context->cpu >= 0 &&
+          getsockopt(client_sock_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &sin_size) == 0)
+        __atomic_fetch_add(incoming_cpu == context->cpu ? &incoming_cpu_local : &incoming_cpu_other, 1, __ATOMIC_RELAXED);
+
+      // process the request with the `process_request` helper function defined above.
+      if (process_request(client_sock_fds[i], &client_addrs[i])) {
+        // `shutdown` ended the conversation, but the file descriptor stays allocated until we `close` it.
+        close(client_sock_fds[i]);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+  `int open_listener(int cpu)` opens a worker's listening socket on PORT and returns its file
+  descriptor, or -1 on failure.  `cpu` is the CPU the worker is pinned to, or -1 if it isn't.
+*/
+int open_listener(int cpu) {
+  int host_sock_fd;
+  int option_value = 1;
+
+  struct sockaddr_in host_addr;
 
   /* 
     `int socket(int domain, int type, int protocol) creates a socket. It returns the file descriptor
@@ -263,7 +5781,7 @@ int main(void) {
   */
   if ((host_sock_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
     printf("Failed to create socket");
-    return 1;
+    return -1;
   }
 
   /*
@@ -290,9 +5808,26 @@ int main(void) {
   */
   if (setsockopt(host_sock_fd, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(int)) == -1) {
     printf("%s", "Error while configuring socket's re-use option equal to true\n");
-    return 1;
+    return -1;
+  }
+
+  /*
+    SO_REUSEPORT lets every worker's listening socket bind to the same port.  The kernel then shares
+    out incoming connections among them.
+  */
+  if (setsockopt(host_sock_fd, SOL_SOCKET, SO_REUSEPORT, &option_value, sizeof(int)) == -1) {
+    printf("%s", "Error while configuring socket's port re-use option equal to true\n");
+    return -1;
   }
 
+  /*
+    SO_INCOMING_CPU tags the socket with the CPU its worker is pinned to.  Among sockets sharing a
+    port, the kernel gives a new connection to the one tagged with the CPU that received the
+    connection's packets, if there is one, rather than picking one at random.
+  */
+  if (cpu >= 0 && setsockopt(host_sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int)) == -1)
+    printf("%s", "SO_INCOMING_CPU not supported\n");
+
   /*
     `host_addr` (defined earlier) is a variable of the sockaddr_in struct type, which is defined in /usr/include/netinet/in.h
     It's a structure that essentially defines an Internet Address.  This structure has four components:
@@ -344,9 +5879,52 @@ int main(void) {
     internet ("sockaddr_in" is short for "socket address internet") and it's easier to work with. 
     This trick of using sockaddr_in and then typecasting it to sockaddr is a common networking hack.
   */
-  if (bind(host_sock_fd, (struct sockaddr *)&host_addr, sizeof(struct sockaddr)) == 1) {
+  if (bind(host_sock_fd, (struct sockaddr *)&host_addr, sizeof(struct sockaddr)) == -1) {
     printf("%s", "Failed to Bind Socket to Host Address\n");
-    return 1;
+    return -1;
+  }
+
+  /*
+    Put the listening socket in non-blocking mode, so the workers can tell when they've drained
+    its queue (see `worker`).  `fcntl` reads and writes a file descriptor's flags.
+  */
+  fcntl(host_sock_fd, F_SETFL, fcntl(host_sock_fd, F_GETFL) | O_NONBLOCK);
+
+  /*
+    TCP_DEFER_ACCEPT tells the kernel to finish the TCP handshake as usual, but to keep the new
+    connection to itself until the client has actually sent something.  Browsers like to open
+    connections "just in case"; with this option those never wake a worker, and by the time a
+    worker does `accept` a connection, its request is already there to read.
+  */
+  option_value = DEFER_ACCEPT_SECONDS;
+  if (setsockopt(host_sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &option_value, sizeof(int)) == -1)
+    printf("%s", "TCP_DEFER_ACCEPT not supported\n");
+
+  /*
+    TCP Fast Open (RFC 7413) lets a client that has connected to us before send its request inside
+    the SYN packet that opens the connection, instead of waiting a round trip for the handshake to
+    finish.  The option's value is how many such connections may be queued.  The kernel only allows
+    it on the server side if bit 2 of the net.ipv4.tcp_fastopen sysctl is set.
+  */
+  option_value = FASTOPEN_QUEUE;
+  if (setsockopt(host_sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &option_value, sizeof(int)) == -1)
+    printf("%s", "TCP_FASTOPEN not supported\n");
+
+  /*
+    In busy-poll mode, SO_BUSY_POLL has reads on this socket poll the network card's receive queue
+    for up to that many microseconds before waiting for an interrupt, SO_PREFER_BUSY_POLL asks the
+    kernel to leave the polling to us while we're doing it, and SO_BUSY_POLL_BUDGET caps the packets
+    picked up per poll.  Sockets returned by `accept4` inherit all three from this one.  (`epoll`
+    itself only busy polls if the net.core.busy_poll sysctl is set as well.)
+  */
+  if (BUSY_POLL_MICROSECONDS > 0) {
+    option_value = BUSY_POLL_MICROSECONDS;
+    if (setsockopt(host_sock_fd, SOL_SOCKET, SO_BUSY_POLL, &option_value, sizeof(int)) == -1)
+      printf("%s", "SO_BUSY_POLL not allowed, spinning in user space only\n");
+    option_value = 1;
+    setsockopt(host_sock_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &option_value, sizeof(int));
+    option_value = BUSY_POLL_BUDGET;
+    setsockopt(host_sock_fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &option_value, sizeof(int));
   }
 
   /*
@@ -357,43 +5935,119 @@ int main(void) {
     that's the limit on the listen queue, as it's only advisory: 
     http://stackoverflow.com/questions/5111040/listen-ignores-the-backlog-argument
 
-    In the invocation below, the suggested size of the listen queue is set to 20.
+    In the invocation below, the suggested size of the listen queue is set to 1024, so bursts of new
+    connections can wait there for the worker to drain them.
   */
-  if (listen(host_sock_fd, 20) == -1) {
+  if (listen(host_sock_fd, 1024) == -1) {
     printf("%s", "Could not listen to socket\n");
-    return 1;
+    return -1;
   }
 
-  while(1) { // basically run this process forever until control-C'ed
-    sin_size = sizeof(struct sockaddr_in); // get the size of struct type sockaddr_in
+  return host_sock_fd;
+}
+
+int main(void) {
+  int node;
+  int shards = 0;
+  int i;
 
-    /*
-      `int accept(int socket, struct sockaddr address, socklen_t address_len)` accepts a new connection on `socket`.
-      Technically, it accepts the first connection on the queue of pending connections, creates a new socket
-      with the same configuration as `socket` and allocates a new file descriptor for that new socket
-      and then returns that file descriptor, which is connected to a client. 
-      
-      Note this is a blocking call. ie. this will hang until a connection comes in.
-
-      Referring to the invocation below, `client_sock_fd` is connected to a remote client and cannot accept more
-      connections.  However `host_sock_fd` remains open and can accept new connections.
-
-      `accept` also stores the connections address info in `struct sockaddr address`. Referring to the
-      invocation below, the client's address information gets stored in `client_addr` struct,
-      but note we typecast it to the sockaddr type. Again, note the typcasting from sockaddr_in to sockaddr
-      trick in use again here.
-    */
-    client_sock_fd = accept(host_sock_fd, (struct sockaddr *)&client_addr, &sin_size); 
+  pthread_t workers[WORKERS];
+  pthread_t helper;
+  pthread_attr_t attr;
+  cpu_set_t cpu;
+  static sigset_t exit_signals;
 
-    if (client_sock_fd == -1) {
-      printf("%s", "Socket failed to accept.");
+  server_started = now_microseconds();
+  printf("Starting Minimal Web Server on Port %d\n", PORT);
+
+  // Decide where the workers run, and open their listening sockets.
+  place_workers();
+  for (i = 0; i < WORKERS; i++) {
+    if ((worker_contexts[i].listen_fd = open_listener(worker_contexts[i].cpu)) == -1)
+      return 1;
+  }
+  if (REUSEPORT_STEERING)
+    steer_connections();
+
+  // Give every NUMA node that has workers a proxy cache shard of its own, in its own memory ...
+  for (i = 0; i < WORKERS; i++) {
+    node = worker_contexts[i].node;
+    if (proxy_cache_shards[node] != NULL)
+      continue;
+    if ((proxy_cache_shards[node] = numa_alloc(sizeof(struct proxy_cache_shard), node)) == NULL) {
+      printf("%s", "Could not allocate the proxy cache\n");
       return 1;
     }
+    pthread_mutex_init(&proxy_cache_shards[node]->lock, NULL);
+    pthread_cond_init(&proxy_cache_shards[node]->loaded, NULL);
+    shards++;
+  }
+  for (node = 0; node < MAX_NUMA_NODES; node++) {
+    if (proxy_cache_shards[node] == NULL)
+      continue;
+    proxy_cache_shards[node]->size = PROXY_CACHE_SIZE / shards;
+    // ... and a cache arena.  Without one the caches still work, on memory from `malloc`.
+    if (cache_arena_init(&cache_arenas[node], CACHE_ARENA_SIZE / shards, node) == -1)
+      printf("%s", "Could not reserve the cache arena\n");
+  }
+  cache_snapshot_restore();
+
+  /*
+    Writing to a socket whose other end has gone away raises SIGPIPE, which kills the whole process
+    by default.  One client or upstream hanging up early must not take down every worker, so ignore
+    the signal; the failed write then just returns -1 like any other error.
+  */
+  signal(SIGPIPE, SIG_IGN);
+
+  /*
+    Leave SIGINT and SIGTERM to one thread, which saves the cache snapshot before exiting.  The
+    signal mask is inherited, so blocking them here, before any other thread starts, blocks them
+    in every thread but that one (which takes them with `sigwait`).
+  */
+  sigemptyset(&exit_signals);
+  sigaddset(&exit_signals, SIGINT);
+  sigaddset(&exit_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &exit_signals, NULL);
+  if (pthread_create(&helper, NULL, save_on_exit, &exit_signals) != 0)
+    printf("%s", "Could not start the snapshot thread\n");
 
-    // process the request with the `process_request` helper function defined above.
-    process_request(client_sock_fd, &client_addr);
+  // Start warming up the caches, and the disk I/O pool.
+  if (pthread_create(&helper, NULL, warmup, NULL) != 0)
+    printf("%s", "Could not start the warm-up\n");
+  for (i = 0; i < DISK_IO_THREADS; i++) {
+    if (pthread_create(&helper, NULL, disk_io_thread, NULL) != 0)
+      printf("%s", "Could not start disk I/O thread\n");
   }
 
-  return 0;
+  // Start the experimental UDP listener on its own thread, if it's enabled.
+  if (UDP_LISTENER) {
+    pthread_t udp_thread;
+    if (pthread_create(&udp_thread, NULL, udp_listener, NULL) != 0)
+      printf("%s", "Could not start the UDP listener\n");
+  }
+
+  /*
+    Start the workers, then wait on them.  They only ever stop if accepting connections fails.
+
+    A worker is pinned to its CPU before it starts, rather than pinning itself once it's running,
+    so that nothing it touches, not even its first page of stack, is placed on the wrong node.
+  */
+  for (i = 0; i < WORKERS; i++) {
+    pthread_attr_init(&attr);
+    if (worker_contexts[i].cpu >= 0) {
+      CPU_ZERO(&cpu);
+      CPU_SET(worker_contexts[i].cpu, &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu);
+    }
+    if (pthread_create(&workers[i], &attr, worker, &worker_contexts[i]) != 0) {
+      printf("%s", "Could not start worker thread\n");
+      return 1;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  for (i = 0; i < WORKERS; i++)
+    pthread_join(workers[i], NULL);
+
+  return 1;
 }
 